@@ -0,0 +1,68 @@
+/*
+ *  ContinuationController.cpp
+ *  RKLibrary
+ *
+ */
+
+#include "ContinuationController.H"
+
+
+/* ============================================================================== */
+/* Constructor */
+ContinuationController::ContinuationController(double a_thicknessAdjust,
+											   double a_metricAdjust,
+											   double a_tolerance,
+											   double a_initialStep,
+											   int    a_targetIterations) :
+m_thicknessAdjust(a_thicknessAdjust),
+m_metricAdjust(a_metricAdjust),
+m_tolerance(a_tolerance),
+m_targetIterations(a_targetIterations > 0 ? a_targetIterations : 1),
+m_maxIterations(10*m_targetIterations),
+m_minStep(1e-3),
+m_progress(0.0),
+m_step(a_initialStep > 0.0 ? a_initialStep : 0.05),
+m_level(0),
+m_levelIterations(0)
+{
+	/* Nothing to continue */
+	if (m_thicknessAdjust == 1.0 && m_metricAdjust == 1.0) m_progress = 1.0;
+}
+
+/* ============================================================================== */
+/* Adjustment parameters along the path */
+double ContinuationController::thicknessAdjust() const
+{
+	if (finished()) return 1.0;
+	return m_thicknessAdjust + (1.0 - m_thicknessAdjust) * m_progress * m_progress * m_progress;
+}
+
+double ContinuationController::metricAdjust() const
+{
+	if (finished()) return 1.0;
+	return m_metricAdjust + (1.0 - m_metricAdjust) * m_progress;
+}
+
+/* ============================================================================== */
+/* Advance the parameters once the current level has relaxed */
+bool ContinuationController::update(double a_gradientNorm, bool a_stalled)
+{
+	if (finished()) return false;
+
+	m_levelIterations++;
+	bool relaxed = (a_gradientNorm < m_tolerance);
+	if (!relaxed && !a_stalled && m_levelIterations < m_maxIterations) return false;
+
+	/* Size of the next increment from the cost of this level */
+	if (!relaxed || m_levelIterations > m_targetIterations)
+		m_step *= 0.5;
+	else if (m_levelIterations < m_targetIterations/2)
+		m_step *= 2.0;
+	if (m_step < m_minStep) m_step = m_minStep;
+
+	m_progress        = min(1.0, m_progress + m_step);
+	m_levelIterations = 0;
+	m_level++;
+
+	return true;
+}
@@ -0,0 +1,152 @@
+/*
+ *  FIREMinimizer.cpp
+ *  RKLibrary
+ *
+ */
+
+#include "FIREMinimizer.H"
+#include <cstring>
+#include <cmath>
+
+/* FIRE parameters (Bitzek et al. 2006) */
+const int    FIREMinimizer::s_Nmin   = 5;
+const double FIREMinimizer::s_finc   = 1.1;
+const double FIREMinimizer::s_fdec   = 0.5;
+const double FIREMinimizer::s_alpha0 = 0.1;
+const double FIREMinimizer::s_falpha = 0.99;
+
+
+/* ============================================================================== */
+/* Constructor */
+FIREMinimizer::FIREMinimizer(NonEuclideanShell &a_shell, double a_timeStep) :
+ShellMinimizer(a_shell),
+m_eval(a_shell),
+m_x(gsl_vector_alloc(m_size)),
+m_g(gsl_vector_alloc(m_size)),
+m_v(new double[m_size]),
+m_f(0.0),
+m_version(0),
+m_dt(a_timeStep),
+m_dtmax(10*a_timeStep),
+m_dtmin(1e-3*a_timeStep),
+m_alpha(s_alpha0),
+m_positiveSteps(0),
+m_userTimeStep(a_timeStep),
+m_initialStep(0.01),
+m_maxStep(0.1)
+{
+	for (int i=0; i<m_size; i++) m_v[i] = 0.0;
+}
+
+/* ============================================================================== */
+/* Destructor */
+FIREMinimizer::~FIREMinimizer()
+{
+	delete [] m_v;
+	gsl_vector_free(m_x);
+	gsl_vector_free(m_g);
+}
+
+/* ============================================================================== */
+/* Set the initial state */
+void FIREMinimizer::set(const gsl_vector *a_x)
+{
+	double* x = gsl_vector_ptr(m_x, 0);
+	double* g = gsl_vector_ptr(m_g, 0);
+	for (int i=0; i<m_size; i++) x[i] = gsl_vector_get(a_x, i);
+
+	m_f       = m_eval.energyAndGradient(x, g);
+	m_version = m_shell.parameterVersion();
+	restart();
+
+	/* Default time step: the first step moves the state by m_initialStep */
+	if (m_userTimeStep <= 0.0)
+	{
+		double gnorm = sqrt(dot(g,g));
+		m_dt = (gnorm > 0.0) ? sqrt(m_initialStep / gnorm) : 1.0;
+	}
+	else
+	{
+		m_dt = m_userTimeStep;
+	}
+	m_dtmax = 10.0 * m_dt;
+	m_dtmin = 1e-3 * m_dt;
+}
+
+/* ============================================================================== */
+/* Zero the velocity and reset the mixing */
+void FIREMinimizer::restart()
+{
+	for (int i=0; i<m_size; i++) m_v[i] = 0.0;
+	m_alpha         = s_alpha0;
+	m_positiveSteps = 0;
+}
+
+/* ============================================================================== */
+/* One FIRE step */
+int FIREMinimizer::iterate()
+{
+	double* x = gsl_vector_ptr(m_x, 0);
+	double* g = gsl_vector_ptr(m_g, 0);
+
+	/* The energy functional changed (adjustment parameters): refresh the force */
+	if (m_version != m_shell.parameterVersion())
+	{
+		m_f       = m_eval.energyAndGradient(x, g);
+		m_version = m_shell.parameterVersion();
+	}
+
+	/* Power P = F.v with F = -g */
+	double P = -dot(g, m_v);
+	if (P > 0.0)
+	{
+		m_positiveSteps++;
+		if (m_positiveSteps > s_Nmin)
+		{
+			m_dt     = min(m_dt * s_finc, m_dtmax);
+			m_alpha *= s_falpha;
+		}
+	}
+	else
+	{
+		/* Going uphill: stop, step back half a step and slow down */
+		m_positiveSteps = 0;
+		m_dt    = max(m_dt * s_fdec, m_dtmin);
+		m_alpha = s_alpha0;
+		for (int i=0; i<m_size; i++)
+		{
+			x[i]  -= 0.5 * m_dt * m_v[i];
+			m_v[i] = 0.0;
+		}
+	}
+
+	/* Semi-implicit Euler with velocity mixing v = (1-alpha) v + alpha |v| F/|F| */
+	for (int i=0; i<m_size; i++) m_v[i] -= m_dt * g[i];
+
+	double vnorm = sqrt(dot(m_v,m_v));
+	double gnorm = sqrt(dot(g,g));
+	if (gnorm > 0.0)
+	{
+		for (int i=0; i<m_size; i++)
+			m_v[i] = (1.0 - m_alpha) * m_v[i] - m_alpha * vnorm * g[i] / gnorm;
+	}
+
+	/* Limit the displacement of a single step */
+	double step  = m_dt * sqrt(dot(m_v,m_v));
+	double scale = (step > m_maxStep) ? m_maxStep / step : 1.0;
+	for (int i=0; i<m_size; i++) x[i] += scale * m_dt * m_v[i];
+
+	m_f = m_eval.energyAndGradient(x, g);
+
+	/* Blown up: undo the step and slow down */
+	if (!std::isfinite(m_f))
+	{
+		for (int i=0; i<m_size; i++) x[i] -= scale * m_dt * m_v[i];
+		restart();
+		m_dt = max(m_dt * s_fdec, m_dtmin);
+		m_f  = m_eval.energyAndGradient(x, g);
+		if (!std::isfinite(m_f)) return GSL_EBADFUNC;
+	}
+
+	return GSL_SUCCESS;
+}
@@ -0,0 +1,330 @@
+/*
+ *  LBFGSMinimizer.cpp
+ *  RKLibrary
+ *
+ */
+
+#include "LBFGSMinimizer.H"
+#include <cstring>
+#include <cmath>
+
+
+/* ============================================================================== */
+/* Constructor */
+LBFGSMinimizer::LBFGSMinimizer(NonEuclideanShell &a_shell, int a_memory) :
+ShellMinimizer(a_shell),
+m_eval(a_shell),
+m_memory(a_memory > 0 ? a_memory : 1),
+m_stored(0),
+m_head(0),
+m_s(new double*[m_memory]),
+m_y(new double*[m_memory]),
+m_rho(new double[m_memory]),
+m_alpha(new double[m_memory]),
+m_x(gsl_vector_alloc(m_size)),
+m_g(gsl_vector_alloc(m_size)),
+m_d(new double[m_size]),
+m_xtrial(new double[m_size]),
+m_gtrial(new double[m_size]),
+m_f(0.0),
+m_version(0),
+m_c1(1e-4),
+m_c2(0.9),
+m_initialStep(0.01),
+m_maxEvaluations(20),
+m_evaluations(0)
+{
+	for (int i=0; i<m_memory; i++)
+	{
+		m_s[i] = new double[m_size];
+		m_y[i] = new double[m_size];
+	}
+}
+
+/* ============================================================================== */
+/* Destructor */
+LBFGSMinimizer::~LBFGSMinimizer()
+{
+	for (int i=0; i<m_memory; i++)
+	{
+		delete [] m_s[i];
+		delete [] m_y[i];
+	}
+	delete [] m_s;
+	delete [] m_y;
+	delete [] m_rho;
+	delete [] m_alpha;
+	delete [] m_d;
+	delete [] m_xtrial;
+	delete [] m_gtrial;
+	gsl_vector_free(m_x);
+	gsl_vector_free(m_g);
+}
+
+/* ============================================================================== */
+/* Set the initial state */
+void LBFGSMinimizer::set(const gsl_vector *a_x)
+{
+	double* x = gsl_vector_ptr(m_x, 0);
+	for (int i=0; i<m_size; i++) x[i] = gsl_vector_get(a_x, i);
+
+	m_f       = m_eval.energyAndGradient(x, gsl_vector_ptr(m_g, 0));
+	m_version = m_shell.parameterVersion();
+	restart();
+}
+
+/* ============================================================================== */
+/* One L-BFGS iteration */
+int LBFGSMinimizer::iterate()
+{
+	double* x = gsl_vector_ptr(m_x, 0);
+	double* g = gsl_vector_ptr(m_g, 0);
+
+	/* The energy functional changed (adjustment parameters): refresh f and g */
+	if (m_version != m_shell.parameterVersion())
+	{
+		m_f       = m_eval.energyAndGradient(x, g);
+		m_version = m_shell.parameterVersion();
+	}
+
+	if (dot(g,g) == 0.0) return GSL_SUCCESS;
+
+	/* Search direction; fall back to steepest descent if it is not a descent direction */
+	computeDirection();
+	if (!(dot(g,m_d) < 0.0))
+	{
+		restart();
+		computeDirection();
+	}
+
+	double alpha = (m_stored == 0) ? min(1.0, m_initialStep / sqrt(dot(m_d,m_d))) : 1.0;
+	double fnew;
+	if (!lineSearch(alpha, fnew))
+	{
+		if (m_stored == 0) return GSL_ENOPROG;
+
+		/* Retry once along the steepest descent */
+		restart();
+		computeDirection();
+		alpha = min(1.0, m_initialStep / sqrt(dot(m_d,m_d)));
+		if (!lineSearch(alpha, fnew)) return GSL_ENOPROG;
+	}
+
+	/* Store the correction pair s = x_new - x, y = g_new - g */
+	double* s = m_s[m_head];
+	double* y = m_y[m_head];
+	for (int i=0; i<m_size; i++)
+	{
+		s[i] = m_xtrial[i] - x[i];
+		y[i] = m_gtrial[i] - g[i];
+	}
+	double sy = dot(s,y);
+	if (sy > 1e-12 * sqrt(dot(s,s) * dot(y,y)))
+	{
+		m_rho[m_head] = 1.0 / sy;
+		m_head        = (m_head + 1) % m_memory;
+		m_stored      = min(m_stored + 1, m_memory);
+	}
+
+	/* Accept the new state */
+	memcpy(x, m_xtrial, sizeof(double)*m_size);
+	memcpy(g, m_gtrial, sizeof(double)*m_size);
+	m_f = fnew;
+
+	return GSL_SUCCESS;
+}
+
+/* ============================================================================== */
+/* Two-loop recursion: m_d = -H g */
+void LBFGSMinimizer::computeDirection()
+{
+	const double* g = gsl_vector_const_ptr(m_g, 0);
+	double*       q = m_d;
+	for (int i=0; i<m_size; i++) q[i] = g[i];
+
+	for (int k=0; k<m_stored; k++)
+	{
+		int idx = (m_head - 1 - k + m_memory) % m_memory;
+		m_alpha[idx] = m_rho[idx] * dot(m_s[idx], q);
+		for (int i=0; i<m_size; i++) q[i] -= m_alpha[idx] * m_y[idx][i];
+	}
+
+	if (m_stored > 0)
+	{
+		int newest = (m_head - 1 + m_memory) % m_memory;
+		applyInitialHessian(q, m_s[newest], m_y[newest]);
+	}
+	else
+	{
+		applyInitialHessian(q, NULL, NULL);
+	}
+
+	for (int k=m_stored-1; k>=0; k--)
+	{
+		int    idx  = (m_head - 1 - k + m_memory) % m_memory;
+		double beta = m_rho[idx] * dot(m_y[idx], q);
+		for (int i=0; i<m_size; i++) q[i] += (m_alpha[idx] - beta) * m_s[idx][i];
+	}
+
+	for (int i=0; i<m_size; i++) q[i] = -q[i];
+}
+
+/* ============================================================================== */
+/* Initial inverse Hessian: gamma * identity, gamma = s.y / y.y */
+void LBFGSMinimizer::applyInitialHessian(double *a_q, const double *a_s, const double *a_y)
+{
+	if (a_s == NULL) return;
+
+	double gamma = dot(a_s,a_y) / dot(a_y,a_y);
+	for (int i=0; i<m_size; i++) a_q[i] *= gamma;
+}
+
+/* ============================================================================== */
+/* Preconditioned L-BFGS */
+/* ============================================================================== */
+/* Constructor */
+PreconditionedLBFGSMinimizer::PreconditionedLBFGSMinimizer(NonEuclideanShell &a_shell, int a_memory) :
+LBFGSMinimizer(a_shell, a_memory),
+m_Py(new double[m_size])
+{
+}
+
+/* ============================================================================== */
+/* Destructor */
+PreconditionedLBFGSMinimizer::~PreconditionedLBFGSMinimizer()
+{
+	delete [] m_Py;
+}
+
+/* ============================================================================== */
+/* Initial inverse Hessian: gamma * P^{-1}, gamma = s.y / y.P^{-1}y */
+void PreconditionedLBFGSMinimizer::applyInitialHessian(double *a_q, const double *a_s, const double *a_y)
+{
+	m_shell.applyPreconditioner(a_q, a_q);
+	if (a_s == NULL) return;
+
+	m_shell.applyPreconditioner(a_y, m_Py);
+	double yPy = 0.0, sy = 0.0;
+	for (int i=0; i<m_size; i++)
+	{
+		yPy += a_y[i]*m_Py[i];
+		sy  += a_s[i]*a_y[i];
+	}
+	if (yPy > 0.0)
+		for (int i=0; i<m_size; i++) a_q[i] *= sy / yPy;
+}
+
+/* ============================================================================== */
+/* Energy along the search direction */
+double LBFGSMinimizer::phi(double a_alpha)
+{
+	const double* x = gsl_vector_const_ptr(m_x, 0);
+	for (int i=0; i<m_size; i++) m_xtrial[i] = x[i] + a_alpha * m_d[i];
+	m_evaluations++;
+	return m_eval.energy(m_xtrial);
+}
+
+/* ============================================================================== */
+/* Slope along the search direction (also sets m_gtrial) */
+double LBFGSMinimizer::dphi(double a_alpha)
+{
+	const double* x = gsl_vector_const_ptr(m_x, 0);
+	for (int i=0; i<m_size; i++) m_xtrial[i] = x[i] + a_alpha * m_d[i];
+	m_eval.energyAndGradient(m_xtrial, m_gtrial);
+	return dot(m_gtrial, m_d);
+}
+
+/* ============================================================================== */
+/* Strong Wolfe line search: bracketing phase */
+bool LBFGSMinimizer::lineSearch(double a_alpha, double &a_fnew)
+{
+	const double f0 = m_f;
+	const double d0 = dot(gsl_vector_const_ptr(m_g, 0), m_d);
+
+	double aprev = 0.0, fprev = f0, dprev = d0;
+	double a     = a_alpha;
+	m_evaluations = 0;
+
+	for (int i=0; ; i++)
+	{
+		double fa = phi(a);
+		if (!std::isfinite(fa) || fa > f0 + m_c1*a*d0 || (i > 0 && fa >= fprev))
+			return zoom(aprev, a, fprev, fa, dprev, f0, d0, a_fnew);
+
+		double da = dphi(a);
+		if (fabs(da) <= -m_c2*d0)
+		{
+			a_fnew = fa;
+			return true;
+		}
+		if (da >= 0.0)
+			return zoom(a, aprev, fa, fprev, da, f0, d0, a_fnew);
+
+		/* Out of evaluations: the step still decreases the energy */
+		if (m_evaluations >= m_maxEvaluations)
+		{
+			a_fnew = fa;
+			return true;
+		}
+
+		aprev = a;
+		fprev = fa;
+		dprev = da;
+		a    *= 4.0;
+	}
+}
+
+/* ============================================================================== */
+/* Strong Wolfe line search: zoom phase. a_lo satisfies sufficient decrease and */
+/* its slope a_dlo is known, only the energy is known at a_hi                    */
+bool LBFGSMinimizer::zoom(double a_lo, double a_hi, double a_flo, double a_fhi, double a_dlo,
+						  double a_f0, double a_d0, double &a_fnew)
+{
+	while (m_evaluations < m_maxEvaluations)
+	{
+		/* Minimizer of the quadratic through (lo,flo,dlo) and (hi,fhi), safeguarded */
+		double delta = a_hi - a_lo;
+		double denom = 2.0 * (a_fhi - a_flo - a_dlo*delta);
+		double a     = a_lo + 0.5*delta;
+		if (std::isfinite(a_fhi) && denom > 0.0)
+			a = a_lo - a_dlo*delta*delta/denom;
+		double a1 = a_lo + 0.1*delta;
+		double a2 = a_lo + 0.9*delta;
+		double amin = min(a1,a2), amax = max(a1,a2);
+		if (a < amin) a = amin;
+		if (a > amax) a = amax;
+
+		double fa = phi(a);
+		if (!std::isfinite(fa) || fa > a_f0 + m_c1*a*a_d0 || fa >= a_flo)
+		{
+			a_hi  = a;
+			a_fhi = fa;
+		}
+		else
+		{
+			double da = dphi(a);
+			if (fabs(da) <= -m_c2*a_d0)
+			{
+				a_fnew = fa;
+				return true;
+			}
+			if (da*(a_hi - a_lo) >= 0.0)
+			{
+				a_hi  = a_lo;
+				a_fhi = a_flo;
+			}
+			a_lo  = a;
+			a_flo = fa;
+			a_dlo = da;
+		}
+	}
+
+	/* Out of evaluations: accept the lower end if it is a step at all */
+	if (a_lo > 0.0)
+	{
+		dphi(a_lo);
+		a_fnew = a_flo;
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,210 @@
+/*
+ *  MeshBuilder.cpp
+ *  RKLibrary
+ *
+ */
+
+#include <atomic>
+#include <cstdint>
+#include "MeshBuilder.H"
+#include "Errors.H"
+
+
+/* ============================================================================== */
+/* Constructor (the points and triangles must outlive the builder) */
+MeshBuilder::MeshBuilder(const std::vector< TinyVector<double,2> > &a_points,
+						 const std::vector< TinyVector<int,3> > &a_triangles) :
+m_points(a_points),
+m_triangles(a_triangles),
+m_fixed(a_points.size(), -2),
+m_opposite(),
+m_neighbor()
+{
+}
+
+/* ============================================================================== */
+/* Read the distmesh files: a count, then "index u v" and "index n1 n2 n3" lines */
+bool MeshBuilder::readDistmesh(const std::string &a_pointsFileName,
+							   const std::string &a_trianglesFileName,
+							   std::vector< TinyVector<double,2> > &a_points,
+							   std::vector< TinyVector<int,3> > &a_triangles)
+{
+	FILE* in = fopen(a_pointsFileName.c_str(), "r");
+	if (in == NULL) return false;
+	int n = 0;
+	bool ok = (fscanf(in, "%d", &n) == 1 && n >= 0);
+	if (ok) a_points.assign(n, TinyVector<double,2>());
+	for (int k=0; ok && k<n; k++)
+	{
+		int    i;
+		double u, v;
+		ok = (fscanf(in, "%d %lf %lf", &i, &u, &v) == 3 && i >= 0 && i < n);
+		if (ok) {a_points[i](0) = u; a_points[i](1) = v;}
+	}
+	fclose(in);
+	if (!ok) return false;
+
+	in = fopen(a_trianglesFileName.c_str(), "r");
+	if (in == NULL) return false;
+	ok = (fscanf(in, "%d", &n) == 1 && n >= 0);
+	if (ok) a_triangles.assign(n, TinyVector<int,3>());
+	for (int k=0; ok && k<n; k++)
+	{
+		int i, a, b, c;
+		ok = (fscanf(in, "%d %d %d %d", &i, &a, &b, &c) == 4 && i >= 0 && i < n);
+		if (ok) {a_triangles[i](0) = a; a_triangles[i](1) = b; a_triangles[i](2) = c;}
+	}
+	fclose(in);
+	return ok;
+}
+
+/* ============================================================================== */
+/* Clamp the nodes near the sides of the bounding box */
+void MeshBuilder::clampBoundingBox(double a_tolu, double a_tolv)
+{
+	int numberNodes = m_points.size();
+	if (numberNodes == 0) return;
+
+	double umin = m_points[0](0), umax = umin, vmin = m_points[0](1), vmax = vmin;
+	for (int i=1; i<numberNodes; i++)
+	{
+		umin = min(umin, m_points[i](0));
+		umax = max(umax, m_points[i](0));
+		vmin = min(vmin, m_points[i](1));
+		vmax = max(vmax, m_points[i](1));
+	}
+
+	#pragma omp parallel for schedule(static)
+	for (int i=0; i<numberNodes; i++)
+	{
+		double u = m_points[i](0), v = m_points[i](1);
+		bool clamped = (u < umin + a_tolu || u > umax - a_tolu || v < vmin + a_tolv || v > vmax - a_tolv);
+		m_fixed[i] = clamped ? -1 : -2;
+	}
+}
+
+/* ============================================================================== */
+/* Edge adjacency                                                                 */
+/* ============================================================================== */
+/* Half-edge h = 3f+k is the edge of face f opposite to its vertex k. Each slot of */
+/* an open addressing table keeps the first and the second half-edge of an edge;  */
+/* the slot is claimed by a compare-and-swap of the first one, and the key of a   */
+/* slot is that of its first half-edge.                                           */
+static inline uint64_t edgeKey(const TinyVector<int,3> &a_triangle, int a_k)
+{
+	uint64_t a = (uint32_t)a_triangle((a_k+1)%3), b = (uint32_t)a_triangle((a_k+2)%3);
+	return (a < b) ? (a << 32 | b) : (b << 32 | a);
+}
+
+int MeshBuilder::buildNeighbors()
+{
+	int numberNodes = m_points.size();
+	int numberFaces = m_triangles.size();
+	int numberHalf  = 3*numberFaces;
+
+	for (int f=0; f<numberFaces; f++)
+		for (int k=0; k<3; k++)
+			if (m_triangles[f](k) < 0 || m_triangles[f](k) >= numberNodes)
+				Errors::Abort("MeshBuilder::buildNeighbors: triangle with a vertex out of range");
+
+	/* More slots than half-edges: the table never fills, and is at most half */
+	/* full for a closed manifold mesh                                          */
+	int bits = 1;
+	while (((uint64_t)1 << bits) <= (uint64_t)numberHalf) bits++;
+	uint64_t mask = ((uint64_t)1 << bits) - 1;
+
+	std::atomic<int>* first  = new std::atomic<int>[mask+1];
+	std::atomic<int>* second = new std::atomic<int>[mask+1];
+	std::vector<int>  slotOf(numberHalf);
+	std::atomic<int>  nonManifold(0);
+
+	#pragma omp parallel for schedule(static)
+	for (int64_t s=0; s<=(int64_t)mask; s++)
+	{
+		first[s].store(-1, std::memory_order_relaxed);
+		second[s].store(-1, std::memory_order_relaxed);
+	}
+
+	#pragma omp parallel for schedule(static)
+	for (int h=0; h<numberHalf; h++)
+	{
+		const TinyVector<int,3> &t = m_triangles[h/3];
+		if (t((h%3+1)%3) == t((h%3+2)%3)) {slotOf[h] = -1; continue;}	/* degenerate edge */
+
+		uint64_t key = edgeKey(t, h%3);
+		uint64_t s   = (key * 0x9E3779B97F4A7C15ULL) >> (64 - bits);
+		while (true)
+		{
+			int current = -1;
+			if (first[s].compare_exchange_strong(current, h)) break;
+			if (edgeKey(m_triangles[current/3], current%3) == key)
+			{
+				int empty = -1;
+				if (!second[s].compare_exchange_strong(empty, h)) nonManifold++;
+				break;
+			}
+			s = (s + 1) & mask;
+		}
+		slotOf[h] = s;
+	}
+	if (nonManifold > 0)
+		Errors::Abort("MeshBuilder::buildNeighbors: edges shared by more than two triangles");
+
+	/* The face across the edge opposite to vertex k, and its vertex opposite to that edge */
+	m_opposite.assign(numberHalf, -1);
+	m_neighbor.assign(numberHalf, -1);
+	int boundary = 0;
+	#pragma omp parallel for schedule(static) reduction(+:boundary)
+	for (int h=0; h<numberHalf; h++)
+	{
+		if (slotOf[h] < 0) continue;
+		int a = first[slotOf[h]].load(std::memory_order_relaxed);
+		int b = second[slotOf[h]].load(std::memory_order_relaxed);
+		int other = (a == h) ? b : a;
+		if (other < 0 || other/3 == h/3)
+		{
+			if (other < 0) boundary++;
+			continue;
+		}
+		m_neighbor[h] = other/3;
+		m_opposite[h] = m_triangles[other/3](other%3);
+	}
+
+	delete [] first;
+	delete [] second;
+	return boundary;
+}
+
+/* ============================================================================== */
+/* Output in the format of generate_inputs.py (and of the shell constructor)     */
+/* ============================================================================== */
+bool MeshBuilder::writeVertices(const std::string &a_fileName) const
+{
+	FILE* out = fopen(a_fileName.c_str(), "w");
+	if (out == NULL) return false;
+
+	int numberNodes = m_points.size();
+	fprintf(out, "%d\n", numberNodes);
+	for (int i=0; i<numberNodes; i++)
+		fprintf(out, "%d\t%.7f\t%.7f\t%d\n", i, m_points[i](0), m_points[i](1), m_fixed[i]);
+	return fclose(out) == 0;
+}
+
+bool MeshBuilder::writeFaces(const std::string &a_fileName) const
+{
+	if (m_neighbor.size() != 3*m_triangles.size()) Errors::Abort("MeshBuilder::writeFaces: call buildNeighbors() first");
+
+	FILE* out = fopen(a_fileName.c_str(), "w");
+	if (out == NULL) return false;
+
+	int numberFaces = m_triangles.size();
+	fprintf(out, "%d\n", numberFaces);
+	for (int f=0; f<numberFaces; f++)
+	{
+		const TinyVector<int,3> &t = m_triangles[f];
+		fprintf(out, "%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", f, t(0), t(1), t(2),
+				m_opposite[3*f], m_opposite[3*f+1], m_opposite[3*f+2],
+				m_neighbor[3*f], m_neighbor[3*f+1], m_neighbor[3*f+2]);
+	}
+	return fclose(out) == 0;
+}
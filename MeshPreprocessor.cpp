@@ -0,0 +1,70 @@
+/*
+ *  MeshPreprocessor.cpp
+ *  RKLibrary
+ *
+ */
+
+/*
+ Writes the Vertices and Faces inputs of RunShell from the raw point and
+ triangle lists ({sim}_p-distmesh.dat, {sim}_t-distmesh.dat) that
+ generate_inputs.py saves, as generate_inputs.py would, for meshes too large
+ for its Python edge map.
+
+ Usage: MeshPreprocessor <p-distmesh file> <t-distmesh file> <output prefix> [clamp <tolu> <tolv> | free]
+   writes <output prefix>_Vertices and <output prefix>_Faces
+   clamp: nodes within tolu of the u sides or tolv of the v sides of the
+          bounding box are fixed (default: clamp 0.05 0, as generate_inputs.py)
+   free:  no fixed nodes
+
+ Build: g++ -O2 -fopenmp -I. MeshPreprocessor.cpp MeshBuilder.cpp -o MeshPreprocessor
+*/
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include "Main.H"
+#include "Errors.H"
+#include "MeshBuilder.H"
+
+static double secondsSince(const std::chrono::steady_clock::time_point &a_start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - a_start).count();
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 4)
+	{
+		std::cerr << "Usage: " << argv[0] << " <p-distmesh file> <t-distmesh file> <output prefix>"
+				  << " [clamp <tolu> <tolv> | free]" << std::endl;
+		return 1;
+	}
+	std::string pointsFileName    = argv[1];
+	std::string trianglesFileName = argv[2];
+	std::string prefix            = argv[3];
+	std::string mode              = (argc > 4) ? argv[4] : "clamp";
+	double      tolu              = (argc > 5) ? atof(argv[5]) : 0.05;
+	double      tolv              = (argc > 6) ? atof(argv[6]) : 0.0;
+	if (mode != "clamp" && mode != "free") Errors::Abort("Unknown fixed node mode " + mode);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector< TinyVector<double,2> > points;
+	std::vector< TinyVector<int,3> >    triangles;
+	if (!MeshBuilder::readDistmesh(pointsFileName, trianglesFileName, points, triangles))
+		Errors::Abort("Cannot read " + pointsFileName + " and " + trianglesFileName);
+	std::cout << "Read " << points.size() << " points and " << triangles.size() << " triangles in "
+			  << secondsSince(start) << " s" << std::endl;
+
+	start = std::chrono::steady_clock::now();
+	MeshBuilder mesh(points, triangles);
+	if (mode == "clamp") mesh.clampBoundingBox(tolu, tolv);
+	int boundary = mesh.buildNeighbors();
+	std::cout << "Neighbor table (" << boundary << " boundary edges) in " << secondsSince(start) << " s" << std::endl;
+
+	start = std::chrono::steady_clock::now();
+	if (!mesh.writeVertices(prefix + "_Vertices")) Errors::Abort("Cannot write " + prefix + "_Vertices");
+	if (!mesh.writeFaces(prefix + "_Faces"))       Errors::Abort("Cannot write " + prefix + "_Faces");
+	std::cout << "Wrote " << prefix << "_Vertices and " << prefix << "_Faces in " << secondsSince(start) << " s" << std::endl;
+
+	return 0;
+}
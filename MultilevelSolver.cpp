@@ -0,0 +1,239 @@
+/*
+ *  MultilevelSolver.cpp
+ *  RKLibrary
+ *
+ */
+
+#include "MultilevelSolver.H"
+#include "gsl/gsl_multimin.h"
+#include <cmath>
+
+
+/* ============================================================================== */
+/* MeshInterpolator MeshInterpolator MeshInterpolator MeshInterpolator          */
+/* ============================================================================== */
+/* Constructor: sort the triangles into buckets by their bounding boxes */
+MeshInterpolator::MeshInterpolator(const NonEuclideanShell &a_shell) :
+m_shell(a_shell),
+m_numberFaces(a_shell.getFaces().length()),
+m_cells(1),
+m_umin(0.0), m_vmin(0.0), m_du(1.0), m_dv(1.0),
+m_cellStart(),
+m_cellFaces()
+{
+	const Vector<Node*>& nodes = m_shell.getNodes();
+
+	double umin = 1e300, umax = -1e300, vmin = 1e300, vmax = -1e300;
+	for (int f=0; f<m_numberFaces; f++)
+		for (int k=0; k<3; k++)
+		{
+			const TinyVector<double,2>& c = nodes(m_shell.faceNode(f,k))->coordinates();
+			umin = min(umin, c(0)); umax = max(umax, c(0));
+			vmin = min(vmin, c(1)); vmax = max(vmax, c(1));
+		}
+
+	/* About one triangle per bucket */
+	m_cells = (int) sqrt((double) m_numberFaces);
+	if (m_cells < 1) m_cells = 1;
+	m_umin = umin;
+	m_vmin = vmin;
+	m_du   = (umax > umin) ? (umax - umin) / m_cells : 1.0;
+	m_dv   = (vmax > vmin) ? (vmax - vmin) / m_cells : 1.0;
+
+	/* Two passes: count, then fill */
+	m_cellStart.assign(m_cells*m_cells + 1, 0);
+	for (int pass=0; pass<2; pass++)
+	{
+		std::vector<int> next(m_cellStart.begin(), m_cellStart.end()-1);
+		for (int f=0; f<m_numberFaces; f++)
+		{
+			double fumin = 1e300, fumax = -1e300, fvmin = 1e300, fvmax = -1e300;
+			for (int k=0; k<3; k++)
+			{
+				const TinyVector<double,2>& c = nodes(m_shell.faceNode(f,k))->coordinates();
+				fumin = min(fumin, c(0)); fumax = max(fumax, c(0));
+				fvmin = min(fvmin, c(1)); fvmax = max(fvmax, c(1));
+			}
+			int i0 = max(0, min(m_cells-1, (int) floor((fumin - m_umin) / m_du)));
+			int i1 = max(0, min(m_cells-1, (int) floor((fumax - m_umin) / m_du)));
+			int j0 = max(0, min(m_cells-1, (int) floor((fvmin - m_vmin) / m_dv)));
+			int j1 = max(0, min(m_cells-1, (int) floor((fvmax - m_vmin) / m_dv)));
+			for (int i=i0; i<=i1; i++)
+				for (int j=j0; j<=j1; j++)
+				{
+					if (pass == 0) m_cellStart[i*m_cells+j+1]++;
+					else           m_cellFaces[next[i*m_cells+j]++] = f;
+				}
+		}
+		if (pass == 0)
+		{
+			for (int c=0; c<m_cells*m_cells; c++) m_cellStart[c+1] += m_cellStart[c];
+			m_cellFaces.resize(m_cellStart[m_cells*m_cells]);
+		}
+	}
+}
+
+/* ============================================================================== */
+/* Barycentric coordinates of (u,v) with respect to the vertices of a face */
+double MeshInterpolator::barycentric(int a_face, double a_u, double a_v, double *a_lambda) const
+{
+	const Vector<Node*>& nodes = m_shell.getNodes();
+	const TinyVector<double,2>& p0 = nodes(m_shell.faceNode(a_face,0))->coordinates();
+	const TinyVector<double,2>& p1 = nodes(m_shell.faceNode(a_face,1))->coordinates();
+	const TinyVector<double,2>& p2 = nodes(m_shell.faceNode(a_face,2))->coordinates();
+
+	double det = (p1(0)-p0(0))*(p2(1)-p0(1)) - (p2(0)-p0(0))*(p1(1)-p0(1));
+	if (det == 0.0) return -1e300;
+
+	a_lambda[1] = ((a_u-p0(0))*(p2(1)-p0(1)) - (p2(0)-p0(0))*(a_v-p0(1))) / det;
+	a_lambda[2] = ((p1(0)-p0(0))*(a_v-p0(1)) - (a_u-p0(0))*(p1(1)-p0(1))) / det;
+	a_lambda[0] = 1.0 - a_lambda[1] - a_lambda[2];
+
+	return min(a_lambda[0], min(a_lambda[1], a_lambda[2]));
+}
+
+/* ============================================================================== */
+/* Keep the triangle of a bucket that (u,v) is least outside of, if better */
+void MeshInterpolator::searchCell(int a_i, int a_j, double a_u, double a_v,
+								  int &a_best, double &a_bestMin, double *a_bestLambda) const
+{
+	const double inside = -1e-12;
+
+	double lambda[3];
+	for (int k=m_cellStart[a_i*m_cells+a_j]; k<m_cellStart[a_i*m_cells+a_j+1] && a_bestMin < inside; k++)
+	{
+		double m = barycentric(m_cellFaces[k], a_u, a_v, lambda);
+		if (m > a_bestMin)
+		{
+			a_best = m_cellFaces[k]; a_bestMin = m;
+			a_bestLambda[0] = lambda[0]; a_bestLambda[1] = lambda[1]; a_bestLambda[2] = lambda[2];
+		}
+	}
+}
+
+/* ============================================================================== */
+/* Position at (u,v): the triangle containing the point, or else the one it is  */
+/* least outside of, with the barycentric coordinates clamped to the triangle   */
+TinyVector<double,3> MeshInterpolator::position(double a_u, double a_v) const
+{
+	const double inside = -1e-12;
+
+	int    best = -1;
+	double bestMin = -1e300;
+	double bestLambda[3] = {1.0, 0.0, 0.0};
+
+	int i = max(0, min(m_cells-1, (int) floor((a_u - m_umin) / m_du)));
+	int j = max(0, min(m_cells-1, (int) floor((a_v - m_vmin) / m_dv)));
+	searchCell(i, j, a_u, a_v, best, bestMin, bestLambda);
+
+	/* Outside the triangles of the bucket: search the rings of buckets around it, */
+	/* up to the ring after the first one with a triangle                          */
+	if (bestMin < inside)
+	{
+		int lastRing = (best >= 0) ? 1 : m_cells;
+		for (int r=1; r<=lastRing && r<m_cells && bestMin < inside; r++)
+		{
+			for (int ii=max(0, i-r); ii<=min(m_cells-1, i+r); ii++)
+			{
+				int step = (ii == i-r || ii == i+r) ? 1 : 2*r;
+				for (int jj=j-r; jj<=j+r; jj+=step)
+					if (jj >= 0 && jj < m_cells) searchCell(ii, jj, a_u, a_v, best, bestMin, bestLambda);
+			}
+			if (best >= 0) lastRing = min(lastRing, r+1);
+		}
+
+		double sum = 0.0;
+		for (int k=0; k<3; k++) {bestLambda[k] = max(bestLambda[k], 0.0); sum += bestLambda[k];}
+		for (int k=0; k<3; k++) bestLambda[k] /= sum;
+	}
+
+	TinyVector<double,3> ret;
+	if (best < 0) return ret;
+
+	const Vector<Node*>& nodes = m_shell.getNodes();
+	for (int k=0; k<3; k++)
+		for (int d=0; d<3; d++)
+			ret(d) += bestLambda[k] * nodes(m_shell.faceNode(best,k))->position(d);
+
+	return ret;
+}
+
+/* ============================================================================== */
+/* Set the free nodes of the target (in the order of setPositionVector) */
+void MeshInterpolator::interpolate(NonEuclideanShell &a_target) const
+{
+	int size = a_target.SizeOfOptimizationProblem();
+	if (size == 0) return;
+
+	std::vector<double> state(size);
+	const Vector<Node*>& nodes = a_target.getNodes();
+	int j = 0;
+	for (int i=0; i<nodes.length(); i++)
+	{
+		if (nodes(i)->fixed() != -2) continue;
+		TinyVector<double,3> r = position(nodes(i)->coordinates(0), nodes(i)->coordinates(1));
+		state[3*j]   = r(0);
+		state[3*j+1] = r(1);
+		state[3*j+2] = r(2);
+		j++;
+	}
+	a_target.setPositionVector(&state[0]);
+}
+
+
+/* ============================================================================== */
+/* MultilevelSolver MultilevelSolver MultilevelSolver MultilevelSolver          */
+/* ============================================================================== */
+/* Constructor */
+MultilevelSolver::MultilevelSolver(const std::string &a_minimizer, int a_maxIterations, double a_tolerance) :
+m_levels(),
+m_minimizer(a_minimizer),
+m_maxIterations(a_maxIterations),
+m_tolerance(a_tolerance),
+m_verbosity(1)
+{
+}
+
+/* ============================================================================== */
+/* Relax the levels from coarse to fine, then warm-start the target */
+void MultilevelSolver::solve(NonEuclideanShell &a_target)
+{
+	for (int l=0; l<(int)m_levels.size(); l++)
+	{
+		if (l > 0) MeshInterpolator(*m_levels[l-1]).interpolate(*m_levels[l]);
+		relax(*m_levels[l], l);
+	}
+
+	if (!m_levels.empty()) MeshInterpolator(*m_levels.back()).interpolate(a_target);
+}
+
+/* ============================================================================== */
+/* Minimize the energy of one level */
+void MultilevelSolver::relax(NonEuclideanShell &a_shell, int a_level)
+{
+	int size = a_shell.SizeOfOptimizationProblem();
+	if (size == 0) return;
+
+	ShellMinimizer* optimizer = ShellMinimizer::create(m_minimizer, a_shell);
+	if (optimizer == NULL) Errors::Abort("Unknown minimizer " + m_minimizer);
+
+	gsl_vector* x = gsl_vector_alloc(size);
+	a_shell.getPositionVector(x);
+	optimizer->set(x);
+
+	int iter;
+	for (iter=0; iter<m_maxIterations; iter++)
+	{
+		if (optimizer->iterate()) break;
+		if (gsl_multimin_test_gradient(optimizer->gradient(), m_tolerance) == GSL_SUCCESS) break;
+	}
+	a_shell.setPositionVector(optimizer->x());
+
+	if (m_verbosity>0)
+		std::cout << "MultilevelSolver::relax()   Level " << a_level << ": "
+				  << a_shell.getFaces().length() << " faces, " << iter << " iterations, energy "
+				  << optimizer->f() << std::endl;
+
+	gsl_vector_free(x);
+	delete optimizer;
+}
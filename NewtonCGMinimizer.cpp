@@ -0,0 +1,181 @@
+/*
+ *  NewtonCGMinimizer.cpp
+ *  RKLibrary
+ *
+ */
+
+#include "NewtonCGMinimizer.H"
+#include <cstring>
+#include <cmath>
+
+
+/* ============================================================================== */
+/* Constructor */
+NewtonCGMinimizer::NewtonCGMinimizer(NonEuclideanShell &a_shell, double a_radius) :
+ShellMinimizer(a_shell),
+m_eval(a_shell),
+m_x(gsl_vector_alloc(m_size)),
+m_g(gsl_vector_alloc(m_size)),
+m_p(new double[m_size]),
+m_r(new double[m_size]),
+m_d(new double[m_size]),
+m_Hd(new double[m_size]),
+m_xtrial(new double[m_size]),
+m_f(0.0),
+m_version(0),
+m_radius(a_radius > 0.0 ? a_radius : 0.1),
+m_initialRadius(m_radius),
+m_maxRadius(100.0*m_radius),
+m_minRadius(1e-12*m_radius),
+m_eta(1e-4),
+m_maxCGIterations(m_size > 200 ? 200 : m_size),
+m_cgIterations(0),
+m_productCalls(0)
+{
+}
+
+/* ============================================================================== */
+/* Destructor */
+NewtonCGMinimizer::~NewtonCGMinimizer()
+{
+	delete [] m_p;
+	delete [] m_r;
+	delete [] m_d;
+	delete [] m_Hd;
+	delete [] m_xtrial;
+	gsl_vector_free(m_x);
+	gsl_vector_free(m_g);
+}
+
+/* ============================================================================== */
+/* Set the initial state */
+void NewtonCGMinimizer::set(const gsl_vector *a_x)
+{
+	double* x = gsl_vector_ptr(m_x, 0);
+	for (int i=0; i<m_size; i++) x[i] = gsl_vector_get(a_x, i);
+
+	m_f       = m_eval.energyAndGradient(x, gsl_vector_ptr(m_g, 0));
+	m_version = m_shell.parameterVersion();
+	restart();
+}
+
+/* ============================================================================== */
+/* One trust region Newton step */
+int NewtonCGMinimizer::iterate()
+{
+	double* x = gsl_vector_ptr(m_x, 0);
+	double* g = gsl_vector_ptr(m_g, 0);
+
+	/* The energy functional changed (adjustment parameters): refresh f and g */
+	if (m_version != m_shell.parameterVersion())
+	{
+		m_f       = m_eval.energyAndGradient(x, g);
+		m_version = m_shell.parameterVersion();
+	}
+
+	if (dot(g,g) == 0.0) return GSL_SUCCESS;
+
+	bool   onBoundary = false;
+	double predicted  = solveSubproblem(onBoundary);
+	double steplength = sqrt(dot(m_p,m_p));
+
+	for (int i=0; i<m_size; i++) m_xtrial[i] = x[i] + m_p[i];
+	double ftrial = m_eval.energy(m_xtrial);
+	double rho    = (predicted > 0.0 && std::isfinite(ftrial)) ? (m_f - ftrial) / predicted : -1.0;
+
+	/* Adapt the radius to the quality of the model */
+	if (rho < 0.25)
+		m_radius = 0.25 * steplength;
+	else if (rho > 0.75 && onBoundary)
+		m_radius = min(2.0 * m_radius, m_maxRadius);
+
+	if (rho > m_eta)
+	{
+		m_f = m_eval.energyAndGradient(m_xtrial, g);
+		memcpy(x, m_xtrial, sizeof(double)*m_size);
+	}
+	else if (m_radius < m_minRadius)
+	{
+		return GSL_ENOPROG;
+	}
+
+	return GSL_SUCCESS;
+}
+
+/* ============================================================================== */
+/* Steihaug CG: minimize g.p + p.H p/2 with |p| <= radius */
+double NewtonCGMinimizer::solveSubproblem(bool &a_onBoundary)
+{
+	const double* x = gsl_vector_const_ptr(m_x, 0);
+	const double* g = gsl_vector_const_ptr(m_g, 0);
+
+	for (int i=0; i<m_size; i++)
+	{
+		m_p[i] = 0.0;
+		m_r[i] = g[i];
+		m_d[i] = -g[i];
+	}
+
+	double rr        = dot(m_r,m_r);
+	double gnorm     = sqrt(rr);
+	double tolerance = min(0.5, sqrt(gnorm)) * gnorm;
+
+	a_onBoundary   = false;
+	m_cgIterations = 0;
+	for (int j=0; j<m_maxCGIterations; j++)
+	{
+		m_shell.getHessianVectorProduct(x, m_d, m_Hd);
+		m_productCalls++;
+		m_cgIterations++;
+
+		/* Negative curvature or leaving the trust region: stop on the boundary */
+		double dHd   = dot(m_d,m_Hd);
+		double alpha = (dHd > 0.0) ? rr / dHd : 0.0;
+		bool   out   = (dHd <= 0.0);
+		if (!out)
+		{
+			double pp = 0.0;
+			for (int i=0; i<m_size; i++) pp += (m_p[i] + alpha*m_d[i]) * (m_p[i] + alpha*m_d[i]);
+			out = (pp >= m_radius*m_radius);
+		}
+		if (out)
+		{
+			double tau = toBoundary(m_p, m_d);
+			for (int i=0; i<m_size; i++)
+			{
+				m_p[i] += tau * m_d[i];
+				m_r[i] += tau * m_Hd[i];
+			}
+			a_onBoundary = true;
+			break;
+		}
+
+		for (int i=0; i<m_size; i++)
+		{
+			m_p[i] += alpha * m_d[i];
+			m_r[i] += alpha * m_Hd[i];
+		}
+		double rrnew = dot(m_r,m_r);
+		if (sqrt(rrnew) < tolerance) break;
+
+		double beta = rrnew / rr;
+		for (int i=0; i<m_size; i++) m_d[i] = -m_r[i] + beta * m_d[i];
+		rr = rrnew;
+	}
+
+	/* With r = g + H p: m(p) = (g.p + r.p)/2 */
+	return -0.5 * (dot(g,m_p) + dot(m_r,m_p));
+}
+
+/* ============================================================================== */
+/* Positive root of |p + tau d|^2 = radius^2 */
+double NewtonCGMinimizer::toBoundary(const double *a_p, const double *a_d) const
+{
+	double a = dot(a_d,a_d);
+	double b = 2.0 * dot(a_p,a_d);
+	double c = dot(a_p,a_p) - m_radius*m_radius;
+	if (a == 0.0) return 0.0;
+	double disc = b*b - 4.0*a*c;
+	if (disc < 0.0) disc = 0.0;
+	return (-b + sqrt(disc)) / (2.0*a);
+}
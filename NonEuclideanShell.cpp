@@ -7,13 +7,35 @@
  */
 
 #include "NonEuclideanShell.H"
+#include "Profiler.H"
 #include <cassert>
 #include <iostream>
 #include <cmath>
 #include <vector>
+#include <new>
 #include <unordered_map>
 
 
+/* ==============================================================================  */
+/* Copies in the precision of a kernel (Real = float in mixed precision mode)      */
+template <class Real, class E, class Source, int SIZE>
+static TinyVector<Real,SIZE> toPrecision(const TinyVectorExpression<E,Source,SIZE> &a_vec)
+{
+	TinyVector<Real,SIZE> ret;
+	for (int i=0; i<SIZE; i++) ret(i) = (Real)a_vec.self()(i);
+	return ret;
+}
+
+template <class Real, class Source, int SIZE>
+static TinyMatrix<Real,SIZE> toPrecision(const TinyMatrix<Source,SIZE> &a_mat)
+{
+	TinyMatrix<Real,SIZE> ret;
+	for (int i=0; i<SIZE; i++)
+		for (int j=0; j<SIZE; j++) ret(i,j) = (Real)a_mat(i,j);
+	return ret;
+}
+
+
 /* ==============================================================================  */
 /* Face Face Face Face Face Face Face Face Face Face Face Face Face Face Face Face */
 /* ==============================================================================  */
@@ -21,41 +43,34 @@
 Face::Face(const TinyVector<Node*,6> &a_nodes) :
 m_nodes(a_nodes),
 m_faces(),
-m_coordinates(),
-m_edge12(),
-m_edge23(),
-m_edge31(),
-m_nodeconnector1(),
-m_nodeconnector2(),
-m_nodeconnector3(),
-m_nodeconnector4(),
-m_nodeconnector5(),
-m_nodeconnector6(),
-m_Amatrix(),
-m_Apivot(),
-m_Bmatrix(),
-m_Bpivot(),
+m_invJ(),
 m_abar(),
 m_bbar(),
-m_invabar(),
+m_gammabar(),
+m_gammabarTrace(0.0),
+m_gammabarNorm2(0.0),
+m_area(0.0),
+m_lambda(0.0),
+m_mu(0.0),
+m_thickness(0.0),
 m_adjust1(1.0),
 m_adjust2(1.0),
-// **new members** — defaulted to zero/identity as appropriate
-m_gammabar(),      // default‐constructed 2×2 of 2×2 (all zeros)
 m_lambdaG(0.0),
-m_muG(0.0)
+m_muG(0.0),
+m_stencilData(),
+m_interior(false)
 {
 	/* Check that the first 3 Node* are not NULL */
 	assert(m_nodes(0)!=NULL && m_nodes(1)!=NULL && m_nodes(2)!=NULL);
+}
 
-	/* Set the Face coordinates to the average of the Nodes */
-	m_coordinates = (m_nodes(0)->coordinates() + m_nodes(1)->coordinates() + m_nodes(2)->coordinates());
-	m_coordinates.scale(1.0/3.0);
-
-	/* Set the delta-Nodes */
-	m_edge12      = m_nodes(1)->coordinates() - m_nodes(0)->coordinates();
-	m_edge31      = m_nodes(0)->coordinates() - m_nodes(2)->coordinates();
-	m_edge23      = m_nodes(2)->coordinates() - m_nodes(1)->coordinates();
+/* ============================================================================== */
+/* The coordinates of the Face: the average of its vertices */
+TinyVector<double,2> Face::coordinates() const
+{
+	TinyVector<double,2> ret = (m_nodes(0)->coordinates() + m_nodes(1)->coordinates() + m_nodes(2)->coordinates());
+	ret.scale(1.0/3.0);
+	return ret;
 }
 
 /* ============================================================================== */
@@ -63,6 +78,68 @@ m_muG(0.0)
 void Face::assignNeighbors(const TinyVector<Face*,3> &a_faces)
 {
 	m_faces = a_faces;
+
+	/* Interior face: the full stencil, and the metric derivatives are defined */
+	m_interior = (m_nodes(3) != NULL && m_nodes(4) != NULL && m_nodes(5) != NULL &&
+				  m_faces(0) != NULL && m_faces(1) != NULL && m_faces(2) != NULL);
+	if (m_interior)
+	{
+		double du = m_faces(0)->coordinates(0) - m_faces(1)->coordinates(0);
+		double dv = m_faces(0)->coordinates(1) - m_faces(2)->coordinates(1);
+		m_interior = (fabs(du) >= 1e-12 && fabs(dv) >= 1e-12);
+		if (m_interior)
+		{
+			m_stencilData(0) = 1.0/du;
+			m_stencilData(1) = 1.0/dv;
+		}
+	}
+}
+
+/* ============================================================================== */
+/* Geometry of a face in coordinate space, needed only by Face::initialize: the  */
+/* edges, the connectors from the center to the 6 nodes (arbitrary fixed values  */
+/* for missing nodes) and the LU factors of the quadratic fit through the nodes  */
+struct FaceSetup
+{
+	TinyVector<double,2> edge12, edge23, edge31;
+	TinyVector<double,2> connector[6];
+	TinyMatrix<double,6> Bmatrix;
+	TinyVector<int,6>    Bpivot;
+};
+
+/* ============================================================================== */
+/* Fill the setup data of this face */
+void Face::buildSetup(FaceSetup &a_setup) const
+{
+	TinyVector<double,2> center = coordinates();
+
+	/* The delta-Nodes */
+	a_setup.edge12 = m_nodes(1)->coordinates() - m_nodes(0)->coordinates();
+	a_setup.edge31 = m_nodes(0)->coordinates() - m_nodes(2)->coordinates();
+	a_setup.edge23 = m_nodes(2)->coordinates() - m_nodes(1)->coordinates();
+
+	/* Connectors to neighboring nodes */
+	a_setup.connector[3](0) = 0.023;
+	a_setup.connector[3](1) = 0.321;
+	a_setup.connector[4](0) = 0.432;
+	a_setup.connector[4](1) = 0.923;
+	a_setup.connector[5](0) = 0.754;
+	a_setup.connector[5](1) = 0.147;
+	for (int k=0; k<6; k++)
+		if (m_nodes(k) != NULL) a_setup.connector[k] = m_nodes(k)->coordinates() - center;
+
+	/* Construct the B matrix */
+	for (int k=0; k<6; k++)
+	{
+		const TinyVector<double,2>& c = a_setup.connector[k];
+		a_setup.Bmatrix(k,0) = 1.0;
+		a_setup.Bmatrix(k,1) = c(0);
+		a_setup.Bmatrix(k,2) = c(1);
+		a_setup.Bmatrix(k,3) = 0.5*c(0)*c(0);
+		a_setup.Bmatrix(k,4) = c(0)*c(1);
+		a_setup.Bmatrix(k,5) = 0.5*c(1)*c(1);
+	}
+	luDecompose(a_setup.Bmatrix, a_setup.Bpivot);
 }
 
 /* ============================================================================== */
@@ -80,87 +157,66 @@ void Face::initialize(double a_thickness,
 	m_thickness = a_thickness;
 	m_lambda    = a_lambda;
 	m_mu        = a_mu;
-	m_abar      = a_abar;
-	m_bbar      = a_bbar;
-    m_gammabar  = a_gammabar;
+	m_abar(0)   = a_abar(0,0);
+	m_abar(1)   = a_abar(0,1);
+	m_abar(2)   = a_abar(1,1);
+	m_bbar(0)   = a_bbar(0,0);
+	m_bbar(1)   = a_bbar(0,1);
+	m_bbar(2)   = a_bbar(1,1);
     m_lambdaG   = a_lambdaG;
     m_muG       = a_muG;
 
-	/* Calculate the inverse of abar */
-	m_invabar  = m_abar.inverse();
+	/* The connection of the deformed face only has (k,i)(0,j) entries: keep  */
+	/* that half of gammabar, and the trace and norm of the other half         */
+	m_gammabarTrace = 0.0;
+	m_gammabarNorm2 = 0.0;
+	for (int k=0; k<2; k++)
+	{
+		m_gammabarTrace += a_gammabar(k,1)(1,1);
+		for (int i=0; i<2; i++)
+			for (int j=0; j<2; j++)
+			{
+				m_gammabar(k,i)(j) = a_gammabar(k,i)(0,j);
+				m_gammabarNorm2   += a_gammabar(k,i)(1,j) * a_gammabar(k,i)(1,j);
+			}
+	}
 
-	/* Calculate the (reference) area */
-	m_area      = 0.5 * sqrt(m_abar.det()) * fabs(m_edge12(0)*m_edge31(1) - m_edge12(1)*m_edge31(0));
+	FaceSetup setup;
+	buildSetup(setup);
 
-	/* Connectors to neighboring nodes */
-	m_nodeconnector1 = m_nodes(0)->coordinates() - m_coordinates;
-	m_nodeconnector2 = m_nodes(1)->coordinates() - m_coordinates;
-	m_nodeconnector3 = m_nodes(2)->coordinates() - m_coordinates;
-	m_nodeconnector4(0) = 0.023;
-	m_nodeconnector4(1) = 0.321;
-	m_nodeconnector5(0) = 0.432;
-	m_nodeconnector5(1) = 0.923;
-	m_nodeconnector6(0) = 0.754;
-	m_nodeconnector6(1) = 0.147;
-	if (m_nodes(3) != NULL) m_nodeconnector4 = m_nodes(3)->coordinates() - m_coordinates;
-	if (m_nodes(4) != NULL) m_nodeconnector5 = m_nodes(4)->coordinates() - m_coordinates;
-	if (m_nodes(5) != NULL) m_nodeconnector6 = m_nodes(5)->coordinates() - m_coordinates;
-
-	/* Construct the A matrix */
-	m_Amatrix(0,0) =   m_edge23(0)*m_edge23(0);
-	m_Amatrix(0,1) = 2*m_edge23(0)*m_edge23(1);
-	m_Amatrix(0,2) =   m_edge23(1)*m_edge23(1);
-	m_Amatrix(1,0) =   m_edge31(0)*m_edge31(0);
-	m_Amatrix(1,1) = 2*m_edge31(0)*m_edge31(1);
-	m_Amatrix(1,2) =   m_edge31(1)*m_edge31(1);
-	m_Amatrix(2,0) =   m_edge12(0)*m_edge12(0);
-	m_Amatrix(2,1) = 2*m_edge12(0)*m_edge12(1);
-	m_Amatrix(2,2) =   m_edge12(1)*m_edge12(1);
-	luDecompose(m_Amatrix, m_Apivot);
-	double detA = m_Amatrix.det();
-	if (fabs(detA) < 1e-12) {
-		std::cerr << "Warning: m_Amatrix nearly singular!" << std::endl;
-}
+	/* Calculate the (reference) area */
+	m_area      = 0.5 * sqrt(a_abar.det()) * fabs(setup.edge12(0)*setup.edge31(1) - setup.edge12(1)*setup.edge31(0));
+
+	/* The metric is J^-T G J^-1, with J = (edge12 edge31) and G the Gram matrix */
+	/* of the deformed edges                                                     */
+	TinyMatrix<double,2> J;
+	J(0,0) = setup.edge12(0);
+	J(1,0) = setup.edge12(1);
+	J(0,1) = setup.edge31(0);
+	J(1,1) = setup.edge31(1);
+	if (fabs(J.det()) < 1e-12) {
+		std::cerr << "Warning: degenerate face in coordinate space!" << std::endl;
+	}
+	m_invJ = J.inverse();
 
+	/* Rows 3-5 of inv(B): the second form is fitted to the normal offsets of the nodes */
+	for (int j=0; j<6; j++)
+	{
+		TinyVector<double,6> unit;
+		unit(j) = 1.0;
+		TinyVector<double,6> column = luSolve(setup.Bmatrix, setup.Bpivot, unit);
+		for (int r=0; r<3; r++) m_secondForm[r](j) = column(3+r);
+	}
 
-	/* Construct the B matrix */
-	m_Bmatrix(0,0) = 1.0;
-	m_Bmatrix(0,1) = m_nodeconnector1(0);
-	m_Bmatrix(0,2) = m_nodeconnector1(1);
-	m_Bmatrix(0,3) = 0.5*m_nodeconnector1(0)*m_nodeconnector1(0);
-	m_Bmatrix(0,4) = m_nodeconnector1(0)*m_nodeconnector1(1);
-	m_Bmatrix(0,5) = 0.5*m_nodeconnector1(1)*m_nodeconnector1(1);
-	m_Bmatrix(1,0) = 1.0;
-	m_Bmatrix(1,1) = m_nodeconnector2(0);
-	m_Bmatrix(1,2) = m_nodeconnector2(1);
-	m_Bmatrix(1,3) = 0.5*m_nodeconnector2(0)*m_nodeconnector2(0);
-	m_Bmatrix(1,4) = m_nodeconnector2(0)*m_nodeconnector2(1);
-	m_Bmatrix(1,5) = 0.5*m_nodeconnector2(1)*m_nodeconnector2(1);
-	m_Bmatrix(2,0) = 1.0;
-	m_Bmatrix(2,1) = m_nodeconnector3(0);
-	m_Bmatrix(2,2) = m_nodeconnector3(1);
-	m_Bmatrix(2,3) = 0.5*m_nodeconnector3(0)*m_nodeconnector3(0);
-	m_Bmatrix(2,4) = m_nodeconnector3(0)*m_nodeconnector3(1);
-	m_Bmatrix(2,5) = 0.5*m_nodeconnector3(1)*m_nodeconnector3(1);
-	m_Bmatrix(3,0) = 1.0;
-	m_Bmatrix(3,1) = m_nodeconnector4(0);
-	m_Bmatrix(3,2) = m_nodeconnector4(1);
-	m_Bmatrix(3,3) = 0.5*m_nodeconnector4(0)*m_nodeconnector4(0);
-	m_Bmatrix(3,4) = m_nodeconnector4(0)*m_nodeconnector4(1);
-	m_Bmatrix(3,5) = 0.5*m_nodeconnector4(1)*m_nodeconnector4(1);
-	m_Bmatrix(4,0) = 1.0;
-	m_Bmatrix(4,1) = m_nodeconnector5(0);
-	m_Bmatrix(4,2) = m_nodeconnector5(1);
-	m_Bmatrix(4,3) = 0.5*m_nodeconnector5(0)*m_nodeconnector5(0);
-	m_Bmatrix(4,4) = m_nodeconnector5(0)*m_nodeconnector5(1);
-	m_Bmatrix(4,5) = 0.5*m_nodeconnector5(1)*m_nodeconnector5(1);
-	m_Bmatrix(5,0) = 1.0;
-	m_Bmatrix(5,1) = m_nodeconnector6(0);
-	m_Bmatrix(5,2) = m_nodeconnector6(1);
-	m_Bmatrix(5,3) = 0.5*m_nodeconnector6(0)*m_nodeconnector6(0);
-	m_Bmatrix(5,4) = m_nodeconnector6(0)*m_nodeconnector6(1);
-	m_Bmatrix(5,5) = 0.5*m_nodeconnector6(1)*m_nodeconnector6(1);
-	luDecompose(m_Bmatrix, m_Bpivot);
+	/* Second form data of missing nodes (boundary faces): the quadratic form bbar on their connector */
+	if (!m_interior)
+	{
+		for (int k=0; k<3; k++)
+		{
+			const TinyVector<double,2>& c = setup.connector[3+k];
+			m_stencilData(k) = m_bbar(0)*c(0)*c(0) + 2*m_bbar(1)*c(0)*c(1) + m_bbar(2)*c(1)*c(1);
+		}
+	}
 }
 
 /* ============================================================================== */
@@ -190,70 +246,94 @@ TinyVector<double,3> Face::calculateUnitNormal() const
 
 // — stretch —
 double Face::stretchingEnergy() const {
-    double ρ      = stretchingEnergyContentDensity();
-    // double factor = std::pow(m_adjust2, -6)
-    //               * m_area
-    //               * m_thickness
-    //               * m_adjust1;
+    return stretchingEnergyContentDensity() * stretchingWeight();
+}
+
+// — bend —
+double Face::bendingEnergy() const {
+    return bendingEnergyContentDensity() * bendingWeight();
+}
+
+// — connect —
+double Face::connectionEnergy() const {
+    return connectionEnergyContentDensity() * bendingWeight();
+}
+
+/* ============================================================================== */
+/* Total energy of the face */
+double Face::energy() const
+{
+	return (activeTerms() == AllTerms) ? energyKernel<AllTerms>() : energyKernel<StretchingBendingTerms>();
+}
+
+/* ============================================================================== */
+/* Energy with the terms t_terms, for the stencil type of this face */
+template <int t_terms, class Real>
+double Face::energyKernel() const
+{
+	return m_interior ? stencilEnergy<t_terms,true,Real>() : stencilEnergy<t_terms,false,Real>();
+}
+
+/* ============================================================================== */
+/* Energy kernel: the first form and the adjusted reference metric are computed */
+/* once, the bending and connection terms share their weight. The stretching   */
+/* and bending densities are evaluated in Real, weights and sums in double     */
+template <int t_terms, bool t_interior, class Real>
+double Face::stencilEnergy() const
+{
+	TinyVector<Real,3> efg        = firstForm<Real>();
+	TinyMatrix<Real,2> invabarAdj = toPrecision<Real>(invabarAdjusted());
+
 	double invAdjust2_6 = 1.0 / (m_adjust2 * m_adjust2 * m_adjust2 *
 		m_adjust2 * m_adjust2 * m_adjust2
 	);
+	double base   = m_thickness * m_adjust1;
+	double weight = invAdjust2_6 * m_area * base;
 
-	// double base = m_thickness * m_area * m_adjust1;
-
-	double factor = invAdjust2_6 * m_area * m_thickness * m_adjust1;
-	// std::cout << "[DEBUG Face] ρ=" << ρ
-    //           << " area="    << m_area
-    //           << " t="       << m_thickness
-    //           << " a1="      << m_adjust1
-    //           << " a2="      << m_adjust2
-    //           << " factor="  << factor
-    //           << "\n";
-    return ρ * factor;
+	double E = stretchingDensity(efg, invabarAdj) * weight;
+	if (t_terms >= StretchingBendingTerms)
+	{
+		double density = bendingDensity(LMNKernel<t_interior,Real>(), invabarAdj);
+		if (t_terms == AllTerms)
+		{
+			TinyMatrix<double,2> dadu, dadv;
+			if (t_interior) interiorMetricDerivatives(dadu, dadv);
+			else            std::tie(dadu, dadv) = computeMetricDerivatives();
+			density += connectionDensity(toPrecision<double>(efg), dadu, dadv);
+		}
+		E += density * weight * base * base;
+	}
+	return E;
 }
 
-// — bend —
-double Face::bendingEnergy() const {
-    double β      = bendingEnergyContentDensity();
-    // double factor = std::pow(m_adjust2, -6)
-    //               * m_area
-    //               * std::pow(m_thickness * m_adjust1, 3);
+template double Face::energyKernel<StretchingTerm,double>() const;
+template double Face::energyKernel<StretchingBendingTerms,double>() const;
+template double Face::energyKernel<AllTerms,double>() const;
+template double Face::energyKernel<StretchingTerm,float>() const;
+template double Face::energyKernel<StretchingBendingTerms,float>() const;
+template double Face::energyKernel<AllTerms,float>() const;
+
+/* ============================================================================== */
+/* Weights multiplying the energy densities: area * thickness (stretching) and    */
+/* area * thickness^3 (bending and connection), scaled by adjust2^-6               */
+double Face::stretchingWeight() const
+{
 	double invAdjust2_6 = 1.0 / (m_adjust2 * m_adjust2 * m_adjust2 *
 		m_adjust2 * m_adjust2 * m_adjust2
 	);
 
-	double base = m_thickness  * m_adjust1;
-
-	double factor = invAdjust2_6 * m_area * base * base * base;
-    // std::cout << "[DEBUG Face] β=" << β
-    //           << " area="       << m_area
-    //           << " t³a1³="      << std::pow(m_thickness * m_adjust1,3)
-    //           << " a2="         << m_adjust2
-    //           << " factor="     << factor
-    //           << "\n";
-    return β * factor;
+	return invAdjust2_6 * m_area * m_thickness * m_adjust1;
 }
 
-// — connect —
-double Face::connectionEnergy() const {
-    double γ      = connectionEnergyContentDensity();
-    // double factor = std::pow(m_adjust2, -6)
-    //               * m_area
-    //               * std::pow(m_thickness * m_adjust1, 3);
+double Face::bendingWeight() const
+{
 	double invAdjust2_6 = 1.0 / (m_adjust2 * m_adjust2 * m_adjust2 *
 		m_adjust2 * m_adjust2 * m_adjust2
 	);
 
 	double base = m_thickness  * m_adjust1;
 
-	double factor = invAdjust2_6 * m_area * base * base * base;
-    // std::cout << "[DEBUG Face] γ=" << γ
-    //           << " area="        << m_area
-    //           << " t³a1³="       << std::pow(m_thickness * m_adjust1,3)
-    //           << " a2="          << m_adjust2
-    //           << " factor="      << factor
-    //           << "\n";
-    return γ * factor;
+	return invAdjust2_6 * m_area * base * base * base;
 }
 
 
@@ -262,98 +342,86 @@ double Face::connectionEnergy() const {
 /* Calculate stretching energy density */
 double Face::stretchingEnergyContentDensity() const
 {
-	/* Calculate the 2D metric a */
-	TinyVector<double,3> r1 = m_nodes(0)->position();
-	TinyVector<double,3> r2 = m_nodes(1)->position();
-	TinyVector<double,3> r3 = m_nodes(2)->position();
-	TinyVector<double,3> dr12 = r2 - r1;
-	TinyVector<double,3> dr23 = r3 - r2;
-	TinyVector<double,3> dr31 = r1 - r3;
-	TinyVector<double,3> l2;
-	l2(0) = innerProduct(dr23,dr23);
-	l2(1) = innerProduct(dr31,dr31);
-	l2(2) = innerProduct(dr12,dr12);
-	TinyVector<double,3> acomp = luSolve(m_Amatrix,m_Apivot,l2);
-	TinyMatrix<double,2> a;
-	a(0,0) = acomp(0);
-	a(0,1) = acomp(1);
-	a(1,0) = acomp(1);
-	a(1,1) = acomp(2);
-
-	/* Adjust abar with adjustment parameter */
-	TinyMatrix<double,2> abarAdj = m_abar;
-	abarAdj.scale(m_adjust2);
+	return stretchingDensity(EFG());
+}
+
+/* ============================================================================== */
+/* Stretching energy density given the first fundamental form (E,F,G) */
+double Face::stretchingDensity(const TinyVector<double,3> &a_EFG) const
+{
+	return stretchingDensity(a_EFG, invabarAdjusted());
+}
+
+/* ============================================================================== */
+/* The reference metric adjusted with the adjustment parameter, and its inverse */
+TinyMatrix<double,2> Face::abarAdjusted() const
+{
+	TinyMatrix<double,2> abarAdj;
+	abarAdj(0,0) = m_abar(0)*m_adjust2;
+	abarAdj(0,1) = m_abar(1)*m_adjust2;
+	abarAdj(1,0) = m_abar(1)*m_adjust2;
+	abarAdj(1,1) = m_abar(2)*m_adjust2;
 	abarAdj(0,0) += 1.0 - m_adjust2;
 	abarAdj(1,1) += 1.0 - m_adjust2;
-	TinyMatrix<double,2> invabarAdj = abarAdj.inverse();
+	return abarAdj;
+}
+
+TinyMatrix<double,2> Face::invabarAdjusted() const
+{
+	return abarAdjusted().inverse();
+}
+
+/* ============================================================================== */
+/* Stretching energy density given the first form and inv(abar) (adjusted) */
+template <class Real>
+Real Face::stretchingDensity(const TinyVector<Real,3> &a_EFG, const TinyMatrix<Real,2> &a_invabarAdj) const
+{
+	/* The 2D metric a */
+	TinyMatrix<Real,2> a;
+	a(0,0) = a_EFG(0);
+	a(0,1) = a_EFG(1);
+	a(1,0) = a_EFG(1);
+	a(1,1) = a_EFG(2);
+
+	/* a - abar with the adjusted abar, abar = inv(inv(abar)) */
+	TinyMatrix<Real,2> abarAdj = toPrecision<Real>(abarAdjusted());
 
 	/* Calculate inv(abar)(a - abar) */
-	TinyMatrix<double,2> tmp  = invabarAdj*(a - abarAdj);
-
-	// return (m_lambda*tmp.trace()*tmp.trace() + m_mu*(tmp*tmp).trace());
-	double E = (m_lambda * tmp.trace() * tmp.trace() + m_mu * (tmp*tmp).trace());
-// std::cout << "m_lambda = " << m_lambda
-//           << ", m_mu = " << m_mu
-//           << ", thickness = " << m_thickness
-//           << ", area = " << m_area
-//           << ", adjust1 = " << m_adjust1
-//           << ", adjust2 = " << m_adjust2
-//           << ", E = " << E
-//           << std::endl;
-	// std::cout
-    //   << "[DEBUG] m_lambda=" << m_lambda
-    //   << ", m_mu="     << m_mu
-    //   << ", E="        << E
-    //   << "\n";
-	return E;
+	TinyMatrix<Real,2> tmp  = a_invabarAdj*(a - abarAdj);
+
+	return ((Real)m_lambda * tmp.trace() * tmp.trace() + (Real)m_mu * traceProduct(tmp,tmp));
 }
 
 /* ============================================================================== */
 /* Calculate bending energy density */
 double Face::bendingEnergyContentDensity() const
 {
-	/* Save the position of the Face */
-	TinyVector<double,3> my_position = position();
-	TinyVector<double,3> unitnormal = calculateUnitNormal();
-	TinyVector<double,6> rhs;
-	for (int nodeindex=0; nodeindex<6; nodeindex++)
-	{
-		if (m_nodes(nodeindex) != NULL)
-		{
-			TinyVector<double,3> dr = m_nodes(nodeindex)->position() - my_position;
-			rhs(nodeindex) = innerProduct(dr,unitnormal);
-		}
-		else
-		{
-			const TinyVector<double,2>  *ptr = NULL;
-			if (nodeindex==3)      ptr = &m_nodeconnector4;
-			else if (nodeindex==4) ptr = &m_nodeconnector5;
-			else                   ptr = &m_nodeconnector6;
-
-			rhs(nodeindex) = m_bbar(0,0) * (*ptr)(0) * (*ptr)(0) +
-				2*m_bbar(0,1)* (*ptr)(0) * (*ptr)(1) +
-				m_bbar(1,1)* (*ptr)(1) * (*ptr)(1);
-		}
-	}
+	return bendingDensity(LMN());
+}
 
-	TinyVector<double,6> bcomp = luSolve(m_Bmatrix, m_Bpivot, rhs);
-	TinyMatrix<double,2> b;
-	b(0,0) = bcomp(3);
-	b(0,1) = bcomp(4);
-	b(1,0) = bcomp(4);
-	b(1,1) = bcomp(5);
+/* ============================================================================== */
+/* Bending energy density given the second fundamental form (L,M,N) */
+double Face::bendingDensity(const TinyVector<double,3> &a_LMN) const
+{
+	return bendingDensity(a_LMN, invabarAdjusted());
+}
 
-	/* Adjust abar with adjustment parameter */
-	TinyMatrix<double,2> abarAdj = m_abar;
-	abarAdj.scale(m_adjust2);
-	abarAdj(0,0) += 1.0 - m_adjust2;
-	abarAdj(1,1) += 1.0 - m_adjust2;
-	TinyMatrix<double,2> invabarAdj = abarAdj.inverse();
+/* ============================================================================== */
+/* Bending energy density given the second form and inv(abar) (adjusted) */
+template <class Real>
+Real Face::bendingDensity(const TinyVector<Real,3> &a_LMN, const TinyMatrix<Real,2> &a_invabarAdj) const
+{
+	/* b - bbar, with b the 2D second form */
+	TinyMatrix<Real,2> db;
+	db(0,0) = a_LMN(0) - (Real)m_bbar(0);
+	db(0,1) = a_LMN(1) - (Real)m_bbar(1);
+	db(1,0) = a_LMN(1) - (Real)m_bbar(1);
+	db(1,1) = a_LMN(2) - (Real)m_bbar(2);
 
 	/* Calculate inv(abar)(b - bbar) */
-	TinyMatrix<double,2> tmp  = invabarAdj*(b - m_bbar);
+	TinyMatrix<Real,2> tmp  = a_invabarAdj*db;
 
-	return (m_lambda*tmp.trace()*tmp.trace() + m_mu*(tmp*tmp).trace()) / 3;
+	return ((Real)m_lambda*tmp.trace()*tmp.trace() + (Real)m_mu*traceProduct(tmp,tmp)) / 3;
 }
 /* ============================================================================== */
 /* Calculate connection energy density */
@@ -364,31 +432,37 @@ double Face::connectionEnergyContentDensity() const
     if (m_lambdaG == 0.0 && m_muG == 0.0)
         return 0.0;
 
+    TinyMatrix<double,2> da_du, da_dv;
+    std::tie(da_du, da_dv) = computeMetricDerivatives();
+    return connectionDensity(EFG(), da_du, da_dv);
+}
+
+/* ============================================================================== */
+/* Connection energy density given the first fundamental form and its derivatives */
+double Face::connectionDensity(const TinyVector<double,3> &a_EFG,
+							   const TinyMatrix<double,2> &a_dadu,
+							   const TinyMatrix<double,2> &a_dadv) const
+{
     // 1) true Christoffel
-    auto Gamma = computeConnection();
+    auto Gamma = computeConnection(a_EFG, a_dadu, a_dadv);
 
-    // 2) ΔΓ = Γ – Γ̄
-    TinyMatrix<TinyMatrix<double,2>,2> Delta;
+    // 2) ΔΓ = Γ – Γ̄ on the (k,i)(0,l) half; on the other half Γ vanishes
+    TinyMatrix<TinyVector<double,2>,2> Delta;
     for (int k = 0; k < 2; ++k) {
       for (int i = 0; i < 2; ++i) {
-        for (int j = 0; j < 2; ++j) {
-          for (int l = 0; l < 2; ++l) {
-            Delta(k,i)(j,l) = 
-              Gamma(k,i)(j,l) - m_gammabar(k,i)(j,l);
-          }
+        for (int l = 0; l < 2; ++l) {
+          Delta(k,i)(l) = Gamma(k,i)(0,l) - m_gammabar(k,i)(l);
         }
       }
     }
 
-    // 3) trace and Frobenius‐norm²
-    double tr = 0.0, norm2 = 0.0;
+    // 3) trace and Frobenius‐norm², the other half contributes -Γ̄
+    double tr = -m_gammabarTrace, norm2 = m_gammabarNorm2;
     for (int k = 0; k < 2; ++k) {
+      tr += Delta(k,0)(0);
       for (int i = 0; i < 2; ++i) {
-        tr += Delta(k,i)(i,i);
-        for (int j = 0; j < 2; ++j) {
-          for (int l = 0; l < 2; ++l) {
-            norm2 += Delta(k,i)(j,l) * Delta(k,i)(j,l);
-          }
+        for (int l = 0; l < 2; ++l) {
+          norm2 += Delta(k,i)(l) * Delta(k,i)(l);
         }
       }
     }
@@ -403,26 +477,101 @@ double Face::connectionEnergyContentDensity() const
 }
 
 
+/* ============================================================================== */
+/* The first fundamental form is linear in the squared edge lengths l2, so the     */
+/* stretching density is quadratic in l2: with T = sum_e l2_e M_e - I,             */
+/* d2W/dl2_e dl2_f = 2 lambda tr(M_e) tr(M_f) + 2 mu tr(M_e M_f). The Gauss-Newton */
+/* block of vertex i is sum_ef Q_ef (dl2_e/dr_i)(dl2_f/dr_i)^T.                    */
+void Face::stretchingStiffness(TinyMatrix<double,3> *a_blocks) const
+{
+	TinyMatrix<double,2> invabarAdj = invabarAdjusted();
+
+	/* M_e = inv(abar) S_e, S_e the metric obtained from a unit l2_e; with   */
+	/* dr12.dr31 = (l2_0 - l2_1 - l2_2)/2 the Gram matrix of a unit l2_e is */
+	/* ((0,1/2),(1/2,0)), ((0,-1/2),(-1/2,1)), ((1,-1/2),(-1/2,0))          */
+	const double gram[3][3] = {{0.0, 0.5, 0.0}, {0.0, -0.5, 1.0}, {1.0, -0.5, 0.0}};
+	TinyMatrix<double,2> M[3];
+	for (int e=0; e<3; e++)
+	{
+		TinyVector<double,3> c = metricFromGram<double>(gram[e][0], gram[e][1], gram[e][2]);
+		TinyMatrix<double,2> S;
+		S(0,0) = c(0);
+		S(0,1) = c(1);
+		S(1,0) = c(1);
+		S(1,1) = c(2);
+		M[e] = invabarAdj*S;
+	}
+
+	double w = stretchingWeight();
+	double Q[3][3];
+	for (int e=0; e<3; e++)
+		for (int f=0; f<3; f++)
+			Q[e][f] = 2.0 * w * (m_lambda * M[e].trace() * M[f].trace() + m_mu * traceProduct(M[e],M[f]));
+
+	/* l2 = (|r3-r2|^2, |r1-r3|^2, |r2-r1|^2); dl2[e][i] = d l2_e / d r_i */
+	TinyVector<double,3> dr23 = m_nodes(2)->position() - m_nodes(1)->position();
+	TinyVector<double,3> dr31 = m_nodes(0)->position() - m_nodes(2)->position();
+	TinyVector<double,3> dr12 = m_nodes(1)->position() - m_nodes(0)->position();
+	TinyVector<double,3> dl2[3][3];
+	dl2[0][1] = dr23; dl2[0][1].scale(-2.0);
+	dl2[0][2] = dr23; dl2[0][2].scale( 2.0);
+	dl2[1][2] = dr31; dl2[1][2].scale(-2.0);
+	dl2[1][0] = dr31; dl2[1][0].scale( 2.0);
+	dl2[2][0] = dr12; dl2[2][0].scale(-2.0);
+	dl2[2][1] = dr12; dl2[2][1].scale( 2.0);
+
+	for (int i=0; i<3; i++)
+	{
+		a_blocks[i].setToZero();
+		for (int e=0; e<3; e++)
+			for (int f=0; f<3; f++)
+				for (int p=0; p<3; p++)
+					for (int q=0; q<3; q++)
+						a_blocks[i](p,q) += Q[e][f] * dl2[e][i](p) * dl2[f][i](q);
+	}
+}
+
 /* ============================================================================== */
 /* Calculate the first fundamental form */
 TinyVector<double,3> Face::EFG() const
+{
+	return firstForm<double>();
+}
+
+/* ============================================================================== */
+/* The first form in Real; the edges are differences in double, so that short */
+/* edges keep their relative accuracy                                          */
+template <class Real>
+TinyVector<Real,3> Face::firstForm() const
 {
 	/* Calculate the 2D metric a */
 	TinyVector<double,3> r1 = m_nodes(0)->position();
 	TinyVector<double,3> r2 = m_nodes(1)->position();
 	TinyVector<double,3> r3 = m_nodes(2)->position();
-	TinyVector<double,3> dr12 = r2 - r1;
-	TinyVector<double,3> dr23 = r3 - r2;
-	TinyVector<double,3> dr31 = r1 - r3;
-	TinyVector<double,3> l2;
-	l2(0) = innerProduct(dr23,dr23);
-	l2(1) = innerProduct(dr31,dr31);
-	l2(2) = innerProduct(dr12,dr12);
-	TinyVector<double,3> acomp = luSolve(m_Amatrix,m_Apivot,l2);
-	// std::cout << "Face " << this << " a = " << acomp << std::endl;
-
-	return acomp;
+	TinyVector<Real,3>   dr12 = toPrecision<Real>(r2 - r1);
+	TinyVector<Real,3>   dr31 = toPrecision<Real>(r1 - r3);
+	return metricFromGram<Real>(innerProduct(dr12,dr12), innerProduct(dr12,dr31), innerProduct(dr31,dr31));
+}
 
+/* ============================================================================== */
+/* The metric (E,F,G) = J^-T G J^-1 given the Gram matrix G of the deformed edges */
+/* (r2-r1, r1-r3)                                                                */
+template <class Real>
+TinyVector<Real,3> Face::metricFromGram(Real a_g00, Real a_g01, Real a_g11) const
+{
+	TinyMatrix<Real,2> invJ = toPrecision<Real>(m_invJ);
+
+	/* T = G J^-1 */
+	Real t00 = a_g00*invJ(0,0) + a_g01*invJ(1,0);
+	Real t01 = a_g00*invJ(0,1) + a_g01*invJ(1,1);
+	Real t10 = a_g01*invJ(0,0) + a_g11*invJ(1,0);
+	Real t11 = a_g01*invJ(0,1) + a_g11*invJ(1,1);
+
+	TinyVector<Real,3> ret;
+	ret(0) = invJ(0,0)*t00 + invJ(1,0)*t10;
+	ret(1) = invJ(0,0)*t01 + invJ(1,0)*t11;
+	ret(2) = invJ(0,1)*t01 + invJ(1,1)*t11;
+	return ret;
 }
 
 
@@ -468,10 +617,10 @@ Face::computeMetricDerivatives() const
     TinyMatrix<double,2> N2 = m_faces(2)->computeMetric();
 
     // 3) compute parametric differences Δu and Δv
-    double du = m_faces(0)->coordinates()(0)
-              - m_faces(1)->coordinates()(0);
-    double dv = m_faces(0)->coordinates()(1)
-              - m_faces(2)->coordinates()(1);
+    double du = m_faces(0)->coordinates(0)
+              - m_faces(1)->coordinates(0);
+    double dv = m_faces(0)->coordinates(1)
+              - m_faces(2)->coordinates(1);
 	if (fabs(du) < 1e-12 || fabs(dv) < 1e-12) {
 		// handle boundary or degenerate case…
 		return { TinyMatrix<double,2>(), TinyMatrix<double,2>() };
@@ -487,43 +636,63 @@ Face::computeMetricDerivatives() const
     return std::make_pair(da_du, da_dv);
 }
 
+/* ============================================================================== */
+/* The same for an interior face: the neighbors exist and 1/du, 1/dv are known */
+void Face::interiorMetricDerivatives(TinyMatrix<double,2> &a_dadu, TinyMatrix<double,2> &a_dadv) const
+{
+	TinyMatrix<double,2> N0 = m_faces(0)->computeMetric();
+	TinyMatrix<double,2> N1 = m_faces(1)->computeMetric();
+	TinyMatrix<double,2> N2 = m_faces(2)->computeMetric();
+	a_dadu = (N0 - N1) * m_stencilData(0);
+	a_dadv = (N0 - N2) * m_stencilData(1);
+}
+
 /* ============================================================================== */
 /* Calculate the second fundamental form */
 TinyVector<double,3> Face::LMN() const
+{
+	return m_interior ? LMNKernel<true,double>() : LMNKernel<false,double>();
+}
+
+/* ============================================================================== */
+/* Second fundamental form, fitted to the normal offsets of the 6 nodes. Missing */
+/* nodes (boundary faces only) take the bbar fallback in m_stencilData        */
+template <bool t_interior, class Real>
+TinyVector<Real,3> Face::LMNKernel() const
 {
 	/* Save the position of the Face */
 	TinyVector<double,3> my_position = position();
-	TinyVector<double,3> unitnormal = calculateUnitNormal();
-	TinyVector<double,6> rhs;
+	TinyVector<Real,3>   unitnormal = toPrecision<Real>(calculateUnitNormal());
+	TinyVector<Real,6>   rhs;
 	for (int nodeindex=0; nodeindex<6; nodeindex++)
 	{
-		if (m_nodes(nodeindex) != NULL)
+		if (t_interior || m_nodes(nodeindex) != NULL)
 		{
-			TinyVector<double,3> dr = m_nodes(nodeindex)->position() - my_position;
+			TinyVector<Real,3> dr = toPrecision<Real>(m_nodes(nodeindex)->position() - my_position);
 			rhs(nodeindex) = innerProduct(dr,unitnormal);
 		}
 		else
 		{
-			const TinyVector<double,2>  *ptr = NULL;
-			if (nodeindex==3)      ptr = &m_nodeconnector4;
-			else if (nodeindex==4) ptr = &m_nodeconnector5;
-			else                   ptr = &m_nodeconnector6;
-
-			rhs(nodeindex) = m_bbar(0,0) * (*ptr)(0) * (*ptr)(0) +
-				2*m_bbar(0,1)* (*ptr)(0) * (*ptr)(1) +
-				m_bbar(1,1)* (*ptr)(1) * (*ptr)(1);
+			rhs(nodeindex) = (Real)m_stencilData(nodeindex-3);
 		}
 	}
 
-	TinyVector<double,6> bcomp = luSolve(m_Bmatrix, m_Bpivot, rhs);
-	TinyVector<double,3> b;
-	b(0) = bcomp(3);
-	b(1) = bcomp(4);
-	b(2) = bcomp(5);
+	TinyVector<Real,3> b;
+	for (int r=0; r<3; r++) b(r) = innerProduct(toPrecision<Real>(m_secondForm[r]), rhs);
 	return b;
 }
 
 /* ============================================================================== */
+/* Evaluate the densities and the fundamental forms in one pass */
+void Face::evaluateDiagnostics(FaceDiagnostics &a_diag) const
+{
+	a_diag.EFG               = EFG();
+	a_diag.LMN               = LMN();
+	a_diag.stretchingDensity = stretchingDensity(a_diag.EFG);
+	a_diag.bendingDensity    = bendingDensity(a_diag.LMN);
+	a_diag.connectionDensity = connectionEnergyContentDensity();
+}
+/* ============================================================================== */
 
 
 /* ==============================================================================  */
@@ -537,17 +706,26 @@ TinyVector<double,3> Face::LMN() const
      Γᵏ_{ij} = ½ a^{kℓ} ( ∂ᵢ a_{ℓj} + ∂ⱼ a_{ℓi} - ∂_ℓ a_{ij} )
 */
 TinyMatrix<TinyMatrix<double,2>,2> Face::computeConnection() const {
+    TinyMatrix<double,2> da_du, da_dv;
+    std::tie(da_du, da_dv) = computeMetricDerivatives();
+    return computeConnection(EFG(), da_du, da_dv);
+}
+
+/* The same given the first fundamental form of this face and its derivatives */
+TinyMatrix<TinyMatrix<double,2>,2> Face::computeConnection(const TinyVector<double,3> &a_EFG,
+														   const TinyMatrix<double,2> &a_dadu,
+														   const TinyMatrix<double,2> &a_dadv) const {
 	
     // 1) compute metric and its inverse
-    TinyVector<double,3> ef = EFG();
+    const TinyVector<double,3>& ef = a_EFG;
     TinyMatrix<double,2> a;
     a(0,0) = ef(0);  a(0,1) = ef(1);
     a(1,0) = ef(1);  a(1,1) = ef(2);
     TinyMatrix<double,2> inva = a.inverse();
 
-    // 2) get the two derivative‐matrices
-    TinyMatrix<double,2> da_du, da_dv;
-    std::tie(da_du, da_dv) = computeMetricDerivatives();
+    // 2) the two derivative‐matrices
+    const TinyMatrix<double,2>& da_du = a_dadu;
+    const TinyMatrix<double,2>& da_dv = a_dadv;
 
     // 3) extract inva entries into locals
     const double i00 = inva(0,0),
@@ -622,26 +800,97 @@ TinyMatrix<TinyMatrix<double,2>,2> Face::computeConnection() const {
 /* ============================================================================== */
 /* Calculate the energy gradient */
 void Face::setForce() {
-    double ep = 1.e-6;
+    if (activeTerms() == AllTerms) forceKernel<AllTerms>();
+    else                           forceKernel<StretchingBendingTerms>();
+}
+
+template <int t_terms, class Real>
+void Face::forceKernel() {
+    if (m_interior) stencilForce<t_terms,true,Real>();
+    else            stencilForce<t_terms,false,Real>();
+}
+
+template <int t_terms, bool t_interior, class Real>
+void Face::stencilForce() {
+    /* float densities carry ~1e-7 relative error: a larger step keeps the */
+    /* round-off of the difference quotient below its truncation error    */
+    double ep = (sizeof(Real) < sizeof(double)) ? 1.e-4 : 1.e-6;
     for (int i=0; i<6; i++) {
-        if (m_nodes(i) != NULL) {
+        if (t_interior || m_nodes(i) != NULL) {
             for (int comp=0; comp<3; comp++) {
-                m_nodes(i)->position(comp) += ep;
-                double Eplus = energy();
-                m_nodes(i)->position(comp) -= 2*ep;
-                double Eminus = energy();
+                double x0 = m_nodes(i)->position(comp);
+                m_nodes(i)->position(comp) = x0 + ep;
+                double Eplus = stencilEnergy<t_terms,t_interior,Real>();
+                m_nodes(i)->position(comp) = x0 - ep;
+                double Eminus = stencilEnergy<t_terms,t_interior,Real>();
                 double grad = 0.5*(Eplus-Eminus)/ep;
 
                 // Diagnostic print statement here:
                 // std::cout << "Gradient component [" << i << "][" << comp << "] = " << grad << std::endl;
 
                 m_nodes(i)->force(comp) += grad;
-                m_nodes(i)->position(comp) += ep;
+                /* restore exactly, so the result does not depend on the order of the faces */
+                m_nodes(i)->position(comp) = x0;
             }
         }
     }
 }
 
+template void Face::forceKernel<StretchingTerm,double>();
+template void Face::forceKernel<StretchingBendingTerms,double>();
+template void Face::forceKernel<AllTerms,double>();
+template void Face::forceKernel<StretchingTerm,float>();
+template void Face::forceKernel<StretchingBendingTerms,float>();
+template void Face::forceKernel<AllTerms,float>();
+
+/* ============================================================================== */
+/* Second derivatives of the face energy (central differences, step 1e-4) */
+void Face::setHessian(double *a_hessian)
+{
+	double ep = 1.e-4;
+	for (int k=0; k<18*18; k++) a_hessian[k] = 0.0;
+
+	double E0 = energy();
+	for (int a=0; a<18; a++)
+	{
+		Node* na = m_nodes(a/3);
+		if (na == NULL) continue;
+		int    ca = a%3;
+		double xa = na->position(ca);
+
+		na->position(ca) = xa + ep;
+		double Eplus = energy();
+		na->position(ca) = xa - ep;
+		double Eminus = energy();
+		na->position(ca) = xa;
+		a_hessian[18*a+a] = (Eplus - 2.0*E0 + Eminus)/(ep*ep);
+
+		for (int b=a+1; b<18; b++)
+		{
+			Node* nb = m_nodes(b/3);
+			if (nb == NULL) continue;
+			int    cb = b%3;
+			double xb = nb->position(cb);
+
+			na->position(ca) = xa + ep;
+			nb->position(cb) = xb + ep;
+			double Epp = energy();
+			nb->position(cb) = xb - ep;
+			double Epm = energy();
+			na->position(ca) = xa - ep;
+			double Emm = energy();
+			nb->position(cb) = xb + ep;
+			double Emp = energy();
+			na->position(ca) = xa;
+			nb->position(cb) = xb;
+
+			double h = 0.25*(Epp - Epm - Emp + Emm)/(ep*ep);
+			a_hessian[18*a+b] = h;
+			a_hessian[18*b+a] = h;
+		}
+	}
+}
+
 /* ============================================================================== */
 /* NonEuclideanShell NonEuclideanShell NonEuclideanShell NonEuclideanShell    */
 /* ============================================================================== */
@@ -650,10 +899,57 @@ NonEuclideanShell::NonEuclideanShell(const std::string &a_nodesFileName,
 									 const std::string &a_facesFileName) :
 m_nodes(),
 m_faces(),
-m_verbosity(2)
+m_nodeArena(NULL),
+m_faceArena(NULL),
+m_verbosity(2),
+m_activeTerms(AllTerms),
+m_mixedPrecision(false),
+m_mixedPrecisionThreshold(0.0),
+m_adjust1(1.0),
+m_adjust2(1.0),
+m_diagnosticsEnabled(false),
+m_stateVersion(0),
+m_parameterVersion(0),
+m_diagnosticsVersion(0),
+m_diagnostics(),
+m_faceEnergy(),
+m_energyTotal(0.0),
+m_allFacesDirty(true),
+m_faceDirty(),
+m_dirtyFaces(),
+m_faceNodeIndex(),
+m_faceNeighborIndex(),
+m_forceOrder(),
+m_forceColorStart(),
+m_nodeDof(),
+m_numberFreeNodes(0),
+m_hessianRowStart(),
+m_hessianColumn(),
+m_hessianValue(),
+m_hessianSlot(),
+m_faceHessian(),
+m_nodeFaceStart(),
+m_nodeFaces(),
+m_vertexFaceStart(),
+m_vertexFaces(),
+m_edgeNode(),
+m_edgeFace(),
+m_faceEdge(),
+m_freeFaceStart(),
+m_freeFaces(),
+m_freeNodeStart(),
+m_freeNodes(),
+m_relaxOrder(),
+m_relaxColorStart(),
+m_preconditioner(),
+m_preconditionerVersion(0),
+m_hessianState(),
+m_hessianGradient()
 {
 	if (m_verbosity>3) Errors::StepIn("NonEuclideanShell::NonEuclideanShell()");
 
+	Profiler::ScopedTimer timer(Profiler::Setup);
+
 	int		numberNodes, numberFaces;
 	int		n1, n2, n3, n4, n5, n6, f1, f2, f3;
 	int		index;
@@ -663,7 +959,8 @@ m_verbosity(2)
 	/* Take care of Nodes */
 	TextFileHandle nodesFileHandle(a_nodesFileName,FileHandle::OPEN_RD);
 	nodesFileHandle.read(numberNodes);
-	m_nodes = Vector<Node*>(numberNodes);
+	m_nodes     = Vector<Node*>(numberNodes);
+	m_nodeArena = new Node[numberNodes];
 
 	if (m_verbosity>1)
 		std::cout << "NonEuclideanShell::NonEuclideanShell()   Number of Nodes = " << numberNodes << std::endl;
@@ -674,7 +971,7 @@ m_verbosity(2)
 		nodesFileHandle.read(u);
 		nodesFileHandle.read(v);
 		nodesFileHandle.read(isfixed);
-		m_nodes(i)  = new Node();
+		m_nodes(i)  = m_nodeArena + i;
 		m_nodes(i)->coordinates(0) = u;
 		m_nodes(i)->coordinates(1) = v;
 		m_nodes(i)->fixed() = isfixed;
@@ -685,6 +982,9 @@ m_verbosity(2)
 	TextFileHandle facesFileHandle(a_facesFileName,FileHandle::OPEN_RD);
 	facesFileHandle.read(numberFaces);
 	m_faces = Vector<Face*>(numberFaces);
+	m_faceArena = static_cast<Face*>(::operator new(sizeof(Face)*numberFaces));
+	m_faceNodeIndex     = Vector<int>(6*numberFaces);
+	m_faceNeighborIndex = Vector<int>(3*numberFaces);
 
 	if (m_verbosity>1)
 		std::cout << "NonEuclideanShell::NonEuclideanShell()   Number of Faces = " << numberFaces << std::endl;
@@ -710,7 +1010,14 @@ m_verbosity(2)
 		nodeVec(4) = (n5==-1) ? NULL : m_nodes(n5);
 		nodeVec(5) = (n6==-1) ? NULL : m_nodes(n6);
 
-		m_faces(i) = new Face(nodeVec);
+		m_faceNodeIndex(6*i)   = n1;
+		m_faceNodeIndex(6*i+1) = n2;
+		m_faceNodeIndex(6*i+2) = n3;
+		m_faceNodeIndex(6*i+3) = n4;
+		m_faceNodeIndex(6*i+4) = n5;
+		m_faceNodeIndex(6*i+5) = n6;
+
+		m_faces(i) = new (m_faceArena + i) Face(nodeVec);
 	}
 	facesFileHandle.close();
 
@@ -737,57 +1044,390 @@ m_verbosity(2)
 		faceVec(2) = (f3==-1) ? NULL : m_faces(f3);
 
 		m_faces(i)->assignNeighbors(faceVec);
+
+		m_faceNeighborIndex(3*i)   = f1;
+		m_faceNeighborIndex(3*i+1) = f2;
+		m_faceNeighborIndex(3*i+2) = f3;
 	}
 	facesFileHandle2.close();
 
+	/* Which faces see every node, and the edges */
+	buildIncidence();
+
+	/* Cached face energies, filled by the first call to energy() */
+	m_faceEnergy = Vector<double>(numberFaces);
+	m_faceDirty  = Vector<char>(numberFaces);
+	for (int i=0; i<numberFaces; i++) m_faceDirty(i) = 0;
+
+	/* Coordinates of the free nodes, in the order of setPositionVector; */
+	/* periodic images share those of their master                       */
+	m_nodeDof = Vector<int>(numberNodes);
+	m_numberFreeNodes = 0;
+	for (int i=0; i<numberNodes; i++)
+		m_nodeDof(i) = (m_nodes(i)->fixed()==-2) ? 3*(m_numberFreeNodes++) : -1;
+	for (int i=0; i<numberNodes; i++)
+		if (m_nodes(i)->fixed() >= 0) m_nodeDof(i) = m_nodeDof(m_nodes(i)->fixed());
+
+	/* Group the faces for concurrent force calculation */
+	buildForceSchedule();
+
+	/* Node groups and colors for local relaxation */
+	buildRelaxationSchedule();
 }
 
 /* ============================================================================== */
-/* Destructor */
-NonEuclideanShell::~NonEuclideanShell()
+/* Color the faces such that two faces of the same color never move a node     */
+/* that the other reads. A face moves its (up to) 6 nodes when it computes its   */
+/* force, and reads those and the vertices of its neighbors (connection term).   */
+/* Faces that do not fit in 64 colors are left to a serial group at the end.     */
+void NonEuclideanShell::buildForceSchedule()
 {
-	for (int i=0; i<m_nodes.length(); i++) delete m_nodes(i);
-	for (int i=0; i<m_faces.length(); i++) delete m_faces(i);
+	const int maxColors   = 64;
+	int       numberFaces = m_faces.length();
+	int       numberNodes = m_nodes.length();
+
+	std::vector<unsigned long long> readMask(numberNodes, 0ULL);
+	std::vector<unsigned long long> moveMask(numberNodes, 0ULL);
+	std::vector<int>                color(numberFaces, maxColors);
+	std::vector<int>                count(maxColors+1, 0);
+
+	for (int i=0; i<numberFaces; i++)
+	{
+		int moved[6], read[15];
+		int nmoved = 0, nread = 0;
+		for (int k=0; k<6; k++)
+		{
+			int n = m_faceNodeIndex(6*i+k);
+			if (n >= 0) {moved[nmoved++] = n; read[nread++] = n;}
+		}
+		for (int e=0; e<3; e++)
+		{
+			int f = m_faceNeighborIndex(3*i+e);
+			if (f < 0) continue;
+			for (int k=0; k<3; k++) read[nread++] = m_faceNodeIndex(6*f+k);
+		}
+
+		unsigned long long busy = 0ULL;
+		for (int k=0; k<nmoved; k++) busy |= readMask[moved[k]];
+		for (int k=0; k<nread; k++)  busy |= moveMask[read[k]];
+
+		int c = 0;
+		while (c < maxColors && ((busy >> c) & 1ULL)) c++;
+		color[i] = c;
+		count[c]++;
+		if (c == maxColors) continue;
+
+		for (int k=0; k<nmoved; k++) moveMask[moved[k]] |= (1ULL << c);
+		for (int k=0; k<nread; k++)  readMask[read[k]]  |= (1ULL << c);
+	}
+
+	int numberColors = 0;
+	for (int c=0; c<maxColors; c++) if (count[c] > 0) numberColors = c+1;
+
+	/* Faces sorted by color; the serial group (color maxColors) comes last */
+	m_forceColorStart = Vector<int>(numberColors+1);
+	m_forceOrder      = Vector<int>(numberFaces);
+	std::vector<int> next(maxColors+1, 0);
+	int start = 0;
+	for (int c=0; c<=maxColors; c++)
+	{
+		if (c < numberColors) m_forceColorStart(c) = start;
+		if (c == maxColors)   m_forceColorStart(numberColors) = start;
+		next[c] = start;
+		start  += count[c];
+	}
+	/* Interior faces first within every color, so the kernel choice rarely changes */
+	int numberInterior = 0;
+	for (int i=0; i<numberFaces; i++)
+		if (m_faces(i)->interior()) {m_forceOrder(next[color[i]]++) = i; numberInterior++;}
+	for (int i=0; i<numberFaces; i++)
+		if (!m_faces(i)->interior()) m_forceOrder(next[color[i]]++) = i;
+
+	if (m_verbosity>1)
+		std::cout << "NonEuclideanShell::buildForceSchedule()   Number of colors = " << numberColors
+				  << " (serial faces = " << count[maxColors] << ", boundary faces = "
+				  << numberFaces - numberInterior << ")" << std::endl;
 }
 
 /* ============================================================================== */
-/* Set reference forms and parameters */
-void NonEuclideanShell::setParameters(double (*f_thickness)(double, double),
-									  double (*f_lambda)(double, double),
-									  double (*f_mu)(double, double),
-									  TinyMatrix<double,2> (*f_abar)(double, double),
-									  TinyMatrix<double,2> (*f_bbar)(double, double),
-									  TinyVector<double,3> (*f_Pos0)(double, double),
-									  TinyMatrix<TinyMatrix<double,2>,2> (*f_gammabar)(double, double),
-                                      double lambdaG,
-                                      double muG)
+/* Insert a value into a sorted list unless it is there already */
+static void insertSorted(std::vector<int> &a_list, int a_value)
 {
-	for (int i=0; i<m_faces.length(); i++)
-	{
-		double u         = m_faces(i)->coordinates(0);
-		double v         = m_faces(i)->coordinates(1);
-		double thickness = f_thickness(u,v);
-		double lambda    = f_lambda(u,v);
-		double mu        = f_mu(u,v);
-		TinyMatrix<double,2> abar      = f_abar(u,v);
-		TinyMatrix<double,2> bbar      = f_bbar(u,v);
-        TinyMatrix<TinyMatrix<double,2>,2> gammabar = f_gammabar(u, v);
+	int k = a_list.size();
+	while (k > 0 && a_list[k-1] > a_value) k--;
+	if (k > 0 && a_list[k-1] == a_value) return;
+	a_list.insert(a_list.begin()+k, a_value);
+}
 
-		m_faces(i)->initialize(thickness, lambda, mu, abar, bbar, gammabar, lambdaG, muG);
-    }
+/* ============================================================================== */
+/* CSR pattern of the Hessian over the free coordinates. Two free nodes are      */
+/* coupled if they belong to a common face; a periodic image counts as its master. */
+/* Every coupling is a dense 3x3 block, columns are sorted within a row.           */
+void NonEuclideanShell::buildHessianPattern()
+{
+	int numberFaces = m_faces.length();
+	int numberFree  = m_numberFreeNodes;
 
-    // --- initialize node positions (unchanged) ---
-    for (int i = 0; i < m_nodes.length(); ++i) 
+	/* Coupled free nodes of every free node */
+	std::vector< std::vector<int> > coupled(numberFree);
+	for (int f=0; f<numberFaces; f++)
 	{
-        double u = m_nodes(i)->coordinates()(0);
-        double v = m_nodes(i)->coordinates()(1);
-        // auto   P = f_Pos0(u, v);
-        // m_nodes(i)->position()(0) = P(0);
-        // m_nodes(i)->position()(1) = P(1);
-        // m_nodes(i)->position()(2) = P(2);
-		m_nodes(i)->position(0) = f_Pos0(u,v)(0);
-		m_nodes(i)->position(1) = f_Pos0(u,v)(1);
-		m_nodes(i)->position(2) = f_Pos0(u,v)(2);
+		for (int a=0; a<6; a++)
+		{
+			int na = m_faceNodeIndex(6*f+a);
+			if (na < 0 || m_nodeDof(na) < 0) continue;
+			std::vector<int> &row = coupled[m_nodeDof(na)/3];
+			for (int b=0; b<6; b++)
+			{
+				int nb = m_faceNodeIndex(6*f+b);
+				if (nb < 0 || m_nodeDof(nb) < 0) continue;
+
+				insertSorted(row, m_nodeDof(nb)/3);
+			}
+		}
+	}
+
+	/* Scalar CSR: the three rows of a node share its list of column blocks */
+	m_hessianRowStart = Vector<int>(3*numberFree+1);
+	int nonZeros = 0;
+	for (int A=0; A<numberFree; A++)
+		for (int p=0; p<3; p++)
+		{
+			m_hessianRowStart(3*A+p) = nonZeros;
+			nonZeros += 3*coupled[A].size();
+		}
+	m_hessianRowStart(3*numberFree) = nonZeros;
+
+	m_hessianColumn = Vector<int>(nonZeros);
+	m_hessianValue  = Vector<double>(nonZeros);
+	for (int A=0; A<numberFree; A++)
+		for (int p=0; p<3; p++)
+			for (int k=0; k<(int)coupled[A].size(); k++)
+				for (int q=0; q<3; q++)
+				{
+					m_hessianColumn(m_hessianRowStart(3*A+p) + 3*k + q) = 3*coupled[A][k] + q;
+					m_hessianValue (m_hessianRowStart(3*A+p) + 3*k + q) = 0.0;
+				}
+
+	/* Position of every node pair of a face in the row of its first node */
+	m_hessianSlot = Vector<int>(36*numberFaces);
+	for (int f=0; f<numberFaces; f++)
+		for (int a=0; a<6; a++)
+			for (int b=0; b<6; b++)
+			{
+				int na = m_faceNodeIndex(6*f+a);
+				int nb = m_faceNodeIndex(6*f+b);
+				int slot = -1;
+				if (na >= 0 && nb >= 0 && m_nodeDof(na) >= 0 && m_nodeDof(nb) >= 0)
+				{
+					const std::vector<int> &row = coupled[m_nodeDof(na)/3];
+					for (slot=0; row[slot] != m_nodeDof(nb)/3; slot++);
+				}
+				m_hessianSlot(36*f+6*a+b) = slot;
+			}
+
+	if (m_verbosity>1)
+		std::cout << "NonEuclideanShell::buildHessianPattern()   Hessian rows = " << 3*numberFree
+				  << ", non-zeros = " << nonZeros << std::endl;
+}
+
+/* ============================================================================== */
+/* Pack lists into CSR form */
+static void packLists(const std::vector< std::vector<int> > &a_lists, Vector<int> &a_start, Vector<int> &a_entries)
+{
+	int number = a_lists.size();
+	a_start = Vector<int>(number+1);
+	int count = 0;
+	for (int i=0; i<number; i++) {a_start(i) = count; count += a_lists[i].size();}
+	a_start(number) = count;
+	a_entries = Vector<int>(count);
+	for (int i=0; i<number; i++)
+		for (int k=0; k<(int)a_lists[i].size(); k++) a_entries(a_start(i)+k) = a_lists[i][k];
+}
+
+/* ============================================================================== */
+/* Node-to-face incidence (faces depending on a node, faces with a node as a    */
+/* vertex) and the edges of the mesh with their faces                           */
+void NonEuclideanShell::buildIncidence()
+{
+	int numberNodes = m_nodes.length();
+	int numberFaces = m_faces.length();
+
+	/* Nodes read by a face: its stencil and the vertices of its neighbors */
+	std::vector< std::vector<int> > nodeFaces(numberNodes), vertexFaces(numberNodes);
+	for (int f=0; f<numberFaces; f++)
+	{
+		std::vector<int> read;
+		for (int k=0; k<6; k++)
+			if (m_faceNodeIndex(6*f+k) >= 0) insertSorted(read, m_faceNodeIndex(6*f+k));
+		for (int e=0; e<3; e++)
+		{
+			int g = m_faceNeighborIndex(3*f+e);
+			if (g < 0) continue;
+			for (int k=0; k<3; k++) insertSorted(read, m_faceNodeIndex(6*g+k));
+		}
+		for (int k=0; k<(int)read.size(); k++) nodeFaces[read[k]].push_back(f);
+		for (int k=0; k<3; k++) vertexFaces[m_faceNodeIndex(6*f+k)].push_back(f);
+	}
+	packLists(nodeFaces,   m_nodeFaceStart,   m_nodeFaces);
+	packLists(vertexFaces, m_vertexFaceStart, m_vertexFaces);
+
+	/* Edges, found from their lower node */
+	std::vector< std::vector<int> > lowerEdges(numberNodes);
+	std::vector<int>                edgeNode, edgeFace;
+	m_faceEdge = Vector<int>(3*numberFaces);
+	for (int f=0; f<numberFaces; f++)
+		for (int k=0; k<3; k++)
+		{
+			int a  = m_faceNodeIndex(6*f+k);
+			int b  = m_faceNodeIndex(6*f+(k+1)%3);
+			int lo = min(a,b), hi = max(a,b);
+
+			int e = -1;
+			for (int j=0; j<(int)lowerEdges[lo].size(); j++)
+				if (edgeNode[2*lowerEdges[lo][j]+1] == hi) {e = lowerEdges[lo][j]; break;}
+			if (e < 0)
+			{
+				e = edgeNode.size()/2;
+				lowerEdges[lo].push_back(e);
+				edgeNode.push_back(lo); edgeNode.push_back(hi);
+				edgeFace.push_back(f);  edgeFace.push_back(-1);
+			}
+			else
+			{
+				if (edgeFace[2*e+1] >= 0) Errors::Warning("NonEuclideanShell: edge shared by more than two faces");
+				edgeFace[2*e+1] = f;
+			}
+			m_faceEdge(3*f+k) = e;
+		}
+
+	int numberEdges = edgeNode.size()/2;
+	m_edgeNode = Vector<int>(2*numberEdges);
+	m_edgeFace = Vector<int>(2*numberEdges);
+	int numberBoundary = 0;
+	for (int k=0; k<2*numberEdges; k++) {m_edgeNode(k) = edgeNode[k]; m_edgeFace(k) = edgeFace[k];}
+	for (int e=0; e<numberEdges; e++) if (edgeFace[2*e+1] < 0) numberBoundary++;
+
+	if (m_verbosity>1)
+		std::cout << "NonEuclideanShell::buildIncidence()   Number of edges = " << numberEdges
+				  << " (boundary edges = " << numberBoundary << ")" << std::endl;
+}
+
+/* ============================================================================== */
+/* Free nodes with their periodic images and the faces that depend on them. The  */
+/* free nodes are colored such that no face depends on two nodes of one color,   */
+/* so those can be moved concurrently.                                            */
+void NonEuclideanShell::buildRelaxationSchedule()
+{
+	const int maxColors   = 64;
+	int       numberNodes = m_nodes.length();
+	int       numberFaces = m_faces.length();
+	int       numberFree  = m_numberFreeNodes;
+
+	/* Free nodes: the master first, then its images; faces of all of them */
+	std::vector< std::vector<int> > freeNodes(numberFree), freeFaces(numberFree);
+	for (int i=0; i<numberNodes; i++)
+		if (m_nodes(i)->fixed()==-2) freeNodes[m_nodeDof(i)/3].push_back(i);
+	for (int i=0; i<numberNodes; i++)
+		if (m_nodes(i)->fixed()>=0 && m_nodeDof(i)>=0) freeNodes[m_nodeDof(i)/3].push_back(i);
+	for (int A=0; A<numberFree; A++)
+		for (int k=0; k<(int)freeNodes[A].size(); k++)
+		{
+			int n = freeNodes[A][k];
+			for (int j=m_nodeFaceStart(n); j<m_nodeFaceStart(n+1); j++) insertSorted(freeFaces[A], m_nodeFaces(j));
+		}
+	packLists(freeNodes, m_freeNodeStart, m_freeNodes);
+	packLists(freeFaces, m_freeFaceStart, m_freeFaces);
+
+	/* Greedy coloring; nodes that do not fit in 64 colors are relaxed serially at the end */
+	std::vector<unsigned long long> faceMask(numberFaces, 0ULL);
+	std::vector<int>                color(numberFree, maxColors);
+	std::vector<int>                colorCount(maxColors+1, 0);
+	for (int A=0; A<numberFree; A++)
+	{
+		unsigned long long busy = 0ULL;
+		for (int k=0; k<(int)freeFaces[A].size(); k++) busy |= faceMask[freeFaces[A][k]];
+
+		int c = 0;
+		while (c < maxColors && ((busy >> c) & 1ULL)) c++;
+		color[A] = c;
+		colorCount[c]++;
+		if (c == maxColors) continue;
+
+		for (int k=0; k<(int)freeFaces[A].size(); k++) faceMask[freeFaces[A][k]] |= (1ULL << c);
+	}
+
+	int numberColors = 0;
+	for (int c=0; c<maxColors; c++) if (colorCount[c] > 0) numberColors = c+1;
+
+	m_relaxColorStart = Vector<int>(numberColors+1);
+	m_relaxOrder      = Vector<int>(numberFree);
+	std::vector<int> next(maxColors+1, 0);
+	int start = 0;
+	for (int c=0; c<=maxColors; c++)
+	{
+		if (c < numberColors) m_relaxColorStart(c) = start;
+		if (c == maxColors)   m_relaxColorStart(numberColors) = start;
+		next[c] = start;
+		start  += colorCount[c];
+	}
+	for (int A=0; A<numberFree; A++) m_relaxOrder(next[color[A]]++) = A;
+
+	if (m_verbosity>1)
+		std::cout << "NonEuclideanShell::buildRelaxationSchedule()   Number of node colors = " << numberColors
+				  << " (serial nodes = " << colorCount[maxColors] << ")" << std::endl;
+}
+
+/* ============================================================================== */
+/* Destructor */
+NonEuclideanShell::~NonEuclideanShell()
+{
+	/* The faces are constructed in place, in order, as the file is read */
+	for (int i=0; i<m_faces.length(); i++) if (m_faces(i) != NULL) m_faces(i)->~Face();
+	::operator delete(m_faceArena);
+	delete [] m_nodeArena;
+}
+
+/* ============================================================================== */
+/* Set reference forms and parameters */
+void NonEuclideanShell::setParameters(double (*f_thickness)(double, double),
+									  double (*f_lambda)(double, double),
+									  double (*f_mu)(double, double),
+									  TinyMatrix<double,2> (*f_abar)(double, double),
+									  TinyMatrix<double,2> (*f_bbar)(double, double),
+									  TinyVector<double,3> (*f_Pos0)(double, double),
+									  TinyMatrix<TinyMatrix<double,2>,2> (*f_gammabar)(double, double),
+                                      double lambdaG,
+                                      double muG)
+{
+	Profiler::ScopedTimer timer(Profiler::Setup);
+
+	for (int i=0; i<m_faces.length(); i++)
+	{
+		double u         = m_faces(i)->coordinates(0);
+		double v         = m_faces(i)->coordinates(1);
+		double thickness = f_thickness(u,v);
+		double lambda    = f_lambda(u,v);
+		double mu        = f_mu(u,v);
+		TinyMatrix<double,2> abar      = f_abar(u,v);
+		TinyMatrix<double,2> bbar      = f_bbar(u,v);
+        TinyMatrix<TinyMatrix<double,2>,2> gammabar = f_gammabar(u, v);
+
+		m_faces(i)->initialize(thickness, lambda, mu, abar, bbar, gammabar, lambdaG, muG);
+    }
+
+    // --- initialize node positions (unchanged) ---
+    for (int i = 0; i < m_nodes.length(); ++i) 
+	{
+        double u = m_nodes(i)->coordinates()(0);
+        double v = m_nodes(i)->coordinates()(1);
+        // auto   P = f_Pos0(u, v);
+        // m_nodes(i)->position()(0) = P(0);
+        // m_nodes(i)->position()(1) = P(1);
+        // m_nodes(i)->position()(2) = P(2);
+		m_nodes(i)->position(0) = f_Pos0(u,v)(0);
+		m_nodes(i)->position(1) = f_Pos0(u,v)(1);
+		m_nodes(i)->position(2) = f_Pos0(u,v)(2);
     }
 
     // --- fix offsets (unchanged) ---
@@ -798,15 +1438,28 @@ void NonEuclideanShell::setParameters(double (*f_thickness)(double, double),
                 m_nodes(i)->position() - m_nodes(j)->position();
         }
     }
+
+    /* The connection term is evaluated only if some face has nonzero weights */
+    m_activeTerms = StretchingBendingTerms;
+    for (int i=0; i<m_faces.length(); i++)
+        if (m_faces(i)->activeTerms() == AllTerms) m_activeTerms = AllTerms;
+
+    touchParameters();
 }
 /* ============================================================================== */
 /* set the adjustment parameters */
 void NonEuclideanShell::setAdjust(double a_adjust1, double a_adjust2)
 {
+	/* Nothing to do if the parameters did not change */
+	if (a_adjust1 == m_adjust1 && a_adjust2 == m_adjust2) return;
+
+	m_adjust1 = a_adjust1;
+	m_adjust2 = a_adjust2;
 	for (int i=0; i<m_faces.length(); i++)
 	{
 		m_faces(i)->setAdjust(a_adjust1, a_adjust2);
 	}
+	touchParameters();
 }
 
 /* ============================================================================== */
@@ -819,6 +1472,7 @@ void NonEuclideanShell::defaultInitialization()
 		m_nodes(i)->position(1) = m_nodes(i)->coordinates(1);
 		m_nodes(i)->position(2) = 0.1*sin(m_nodes(i)->coordinates(0));
 	}
+	touchState();
 }
 
 /* ============================================================================== */
@@ -837,6 +1491,7 @@ void NonEuclideanShell::restart(BinaryFileHandle* a_fh)
 		m_nodes(i)->position(1) = Y;
 		m_nodes(i)->position(2) = Z;
 	}
+	touchState();
 }
 
 /* ============================================================================== */
@@ -918,19 +1573,207 @@ double NonEuclideanShell::connectionEnergy() const
 /* Calculate the total energy */
 double NonEuclideanShell::energy() const
 {
-    double energy;
-    if (m_faces.length() > 0 && m_faces(0)->getLambdaG() == 0.0 && m_faces(0)->getMuG() == 0.0) {
-    // std::cout << "[DEBUG] Skipping connection energy (lambdaG and muG are zero for all faces)\n";
-    energy = stretchingEnergy() + bendingEnergy();
-	} else {
-    energy = stretchingEnergy() + bendingEnergy() + connectionEnergy();
+    Profiler::ScopedTimer timer(Profiler::Energy);
+    Profiler::count(Profiler::EnergyCalls);
+
+	/* Re-evaluate the faces that depend on moved nodes, all of them after touchState() */
+	int numberFaces = m_faces.length();
+	if (m_allFacesDirty)
+	{
+		evaluateFaceEnergies(true);
+
+		m_energyTotal = 0.0;
+		for (int i=0; i<numberFaces; i++) m_energyTotal += m_faceEnergy(i);
 	}
+	else if (!m_dirtyFaces.empty())
+	{
+		int    numberDirty = m_dirtyFaces.size();
+		double oldEnergy   = 0.0, newEnergy = 0.0, largest = 0.0;
+		for (int k=0; k<numberDirty; k++) oldEnergy += m_faceEnergy(m_dirtyFaces[k]);
 
+		evaluateFaceEnergies(false);
+
+		for (int k=0; k<numberDirty; k++)
+		{
+			newEnergy += m_faceEnergy(m_dirtyFaces[k]);
+			largest    = max(largest, fabs(m_faceEnergy(m_dirtyFaces[k])));
+		}
+		m_energyTotal += newEnergy - oldEnergy;
+
+		/* Large face energies (a blown up trial state) would leave round-off in the */
+		/* running sum: sum the cache again                                          */
+		if (largest > fabs(m_energyTotal) || fabs(oldEnergy) > fabs(m_energyTotal))
+		{
+			m_energyTotal = 0.0;
+			for (int i=0; i<numberFaces; i++) m_energyTotal += m_faceEnergy(i);
+		}
+	}
+
+	for (int k=0; k<(int)m_dirtyFaces.size(); k++) m_faceDirty(m_dirtyFaces[k]) = 0;
+	m_dirtyFaces.clear();
+	m_allFacesDirty = false;
 
     if (m_verbosity > 1)
-        std::cout << "NonEuclideanShell::energy()    = " << energy << std::endl;
+        std::cout << "NonEuclideanShell::energy()    = " << m_energyTotal << std::endl;
 
-    return energy;
+    return m_energyTotal;
+}
+
+/* ============================================================================== */
+/* Energy terms and density statistics in one sweep (no output, for logging) */
+EnergyBreakdown NonEuclideanShell::energyBreakdown() const
+{
+	Profiler::ScopedTimer timer(Profiler::Energy);
+	Profiler::count(Profiler::FaceEnergyEvaluations, m_faces.length());
+
+	EnergyBreakdown ret;
+	ret.stretching  = 0.0;
+	ret.bending     = 0.0;
+	ret.connection  = 0.0;
+	ret.total       = 0.0;
+	ret.minDensity  = 0.0;
+	ret.maxDensity  = 0.0;
+	ret.meanDensity = 0.0;
+
+	FaceDiagnostics diag;
+	double          totalArea = 0.0;
+	for (int i=0; i<m_faces.length(); i++)
+	{
+		FaceDiagnostics& d = m_diagnosticsEnabled ? m_diagnostics(i) : diag;
+		m_faces(i)->evaluateDiagnostics(d);
+
+		double Es = d.stretchingDensity * m_faces(i)->stretchingWeight();
+		double Eb = d.bendingDensity    * m_faces(i)->bendingWeight();
+		double Eg = d.connectionDensity * m_faces(i)->bendingWeight();
+		ret.stretching += Es;
+		ret.bending    += Eb;
+		ret.connection += Eg;
+
+		double density = (Es + Eb + Eg) / m_faces(i)->area();
+		if (i==0 || density < ret.minDensity) ret.minDensity = density;
+		if (i==0 || density > ret.maxDensity) ret.maxDensity = density;
+		totalArea += m_faces(i)->area();
+	}
+	if (m_diagnosticsEnabled) m_diagnosticsVersion = m_stateVersion;
+
+	ret.total = ret.stretching + ret.bending + ret.connection;
+	if (totalArea > 0.0) ret.meanDensity = ret.total / totalArea;
+
+	return ret;
+}
+
+/* ============================================================================== */
+/* Fill the energy cache for all faces or for the dirty ones */
+template <int t_terms, class Real>
+void NonEuclideanShell::evaluateFaceEnergies(bool a_all) const
+{
+	if (a_all)
+	{
+		int numberFaces = m_faces.length();
+		#pragma omp parallel for schedule(static)
+		for (int i=0; i<numberFaces; i++) m_faceEnergy(i) = m_faces(i)->energyKernel<t_terms,Real>();
+	}
+	else
+	{
+		int numberDirty = m_dirtyFaces.size();
+		#pragma omp parallel for schedule(static)
+		for (int k=0; k<numberDirty; k++)
+			m_faceEnergy(m_dirtyFaces[k]) = m_faces(m_dirtyFaces[k])->energyKernel<t_terms,Real>();
+	}
+}
+
+template <class Real>
+void NonEuclideanShell::evaluateFaceEnergies(bool a_all) const
+{
+	switch (m_activeTerms)
+	{
+		case StretchingTerm:         evaluateFaceEnergies<StretchingTerm,Real>(a_all);         break;
+		case StretchingBendingTerms: evaluateFaceEnergies<StretchingBendingTerms,Real>(a_all); break;
+		default:                     evaluateFaceEnergies<AllTerms,Real>(a_all);               break;
+	}
+}
+
+void NonEuclideanShell::evaluateFaceEnergies(bool a_all) const
+{
+	Profiler::count(Profiler::FaceEnergyEvaluations, a_all ? m_faces.length() : (int)m_dirtyFaces.size());
+
+	if (m_mixedPrecision) evaluateFaceEnergies<float>(a_all);
+	else                  evaluateFaceEnergies<double>(a_all);
+}
+
+/* ============================================================================== */
+/* Mixed precision until the gradient norm drops below a_gradientNorm */
+void NonEuclideanShell::setMixedPrecision(double a_gradientNorm)
+{
+	bool mixed = (a_gradientNorm > 0.0);
+	m_mixedPrecisionThreshold = a_gradientNorm;
+	if (mixed != m_mixedPrecision)
+	{
+		m_mixedPrecision = mixed;
+		touchParameters();
+	}
+}
+
+/* ============================================================================== */
+/* Switch to double once a computed gradient is below the threshold */
+void NonEuclideanShell::updatePrecision(const double *a_gradient)
+{
+	if (!m_mixedPrecision) return;
+
+	int    size  = SizeOfOptimizationProblem();
+	double norm2 = 0.0;
+	for (int i=0; i<size; i++) norm2 += a_gradient[i]*a_gradient[i];
+	if (sqrt(norm2) >= m_mixedPrecisionThreshold) return;
+
+	m_mixedPrecision = false;
+	touchParameters();
+	if (m_verbosity>0)
+		std::cout << "NonEuclideanShell::updatePrecision()   Gradient norm " << sqrt(norm2)
+				  << " below " << m_mixedPrecisionThreshold << ": switching to double precision" << std::endl;
+}
+
+/* ============================================================================== */
+/* Flag the faces whose energy depends on a node */
+void NonEuclideanShell::markNodeMoved(int a_node)
+{
+	if (m_allFacesDirty) return;
+
+	VectorView<const int> faces = facesOfNode(a_node);
+	for (int k=0; k<faces.length(); k++)
+	{
+		int f = faces(k);
+		if (m_faceDirty(f)) continue;
+		m_faceDirty(f) = 1;
+		m_dirtyFaces.push_back(f);
+	}
+
+	/* Most faces dirty (a line search step): a full sweep costs less than the bookkeeping */
+	if (4*(int)m_dirtyFaces.size() > m_faces.length())
+	{
+		for (int k=0; k<(int)m_dirtyFaces.size(); k++) m_faceDirty(m_dirtyFaces[k]) = 0;
+		m_dirtyFaces.clear();
+		m_allFacesDirty = true;
+	}
+}
+
+/* ============================================================================== */
+/* Switch the per-face diagnostics buffer on or off */
+void NonEuclideanShell::enableDiagnostics(bool a_enable)
+{
+	m_diagnosticsEnabled = a_enable;
+	if (a_enable && m_diagnostics.length() != m_faces.length())
+		m_diagnostics = Vector<FaceDiagnostics>(m_faces.length());
+	m_diagnosticsVersion = m_stateVersion - 1;
+}
+
+/* ============================================================================== */
+/* Diagnostics of a single face */
+void NonEuclideanShell::getFaceDiagnostics(int a_face, FaceDiagnostics &a_diag) const
+{
+	if (diagnosticsCurrent())
+		a_diag = m_diagnostics(a_face);
+	else
+		m_faces(a_face)->evaluateDiagnostics(a_diag);
 }
 
 /* ============================================================================== */
@@ -954,9 +1797,42 @@ void NonEuclideanShell::setForce()
 {
 	if (m_verbosity>3) Errors::StepIn("NonEuclideanShell::setForce()");
 
-	for (int i=0; i<m_faces.length(); i++)
-		m_faces(i)->setForce();
+	Profiler::ScopedTimer timer(Profiler::Gradient);
+	Profiler::count(Profiler::GradientCalls);
+	Profiler::count(Profiler::FaceForceEvaluations, m_faces.length());
 
+	if (m_mixedPrecision) forceSweep<float>();
+	else                  forceSweep<double>();
+}
+
+template <class Real>
+void NonEuclideanShell::forceSweep()
+{
+	switch (m_activeTerms)
+	{
+		case StretchingTerm:         forceSweep<StretchingTerm,Real>();         break;
+		case StretchingBendingTerms: forceSweep<StretchingBendingTerms,Real>(); break;
+		default:                     forceSweep<AllTerms,Real>();               break;
+	}
+}
+
+template <int t_terms, class Real>
+void NonEuclideanShell::forceSweep()
+{
+	/* Faces of one color are independent (see buildForceSchedule) */
+	int numberColors = m_forceColorStart.length() - 1;
+	for (int c=0; c<numberColors; c++)
+	{
+		int first = m_forceColorStart(c);
+		int last  = m_forceColorStart(c+1);
+		#pragma omp parallel for schedule(static)
+		for (int k=first; k<last; k++)
+			m_faces(m_forceOrder(k))->forceKernel<t_terms,Real>();
+	}
+
+	/* Faces that could not be colored */
+	for (int k=m_forceColorStart(numberColors); k<m_faces.length(); k++)
+		m_faces(m_forceOrder(k))->forceKernel<t_terms,Real>();
 }
 
 /* ============================================================================== */
@@ -998,11 +1874,13 @@ void NonEuclideanShell::DumpStateTextFormat(TextFileHandle* a_node, TextFileHand
 		a_node->newline();
 	}
 
+	FaceDiagnostics diag;
 	for (int i=0; i<m_faces.length(); i++)
 	{
-		double Es = m_faces(i)->stretchingEnergyContentDensity();
-		double Eb = m_faces(i)->bendingEnergyContentDensity();
-		double Eg = m_faces(i)->connectionEnergyContentDensity();
+		getFaceDiagnostics(i, diag);
+		double Es = diag.stretchingDensity;
+		double Eb = diag.bendingDensity;
+		double Eg = diag.connectionDensity;
 		a_face->write(i);
 		a_face->tab();
 		a_face->write(Es);
@@ -1049,14 +1927,16 @@ void NonEuclideanShell::DumpStateTextFormat(TextFileHandle* a_node, TextFileHand
 /* Dump forms (E, F, G, L, M, N) + Γ⁽ᵏ⁾ᵢⱼ (2×2×2 = 8 values) to file (text) */
 void NonEuclideanShell::DumpFormsTextFormat(TextFileHandle* a_face)
 {
+    FaceDiagnostics diag;
     for (int i = 0; i < m_faces.length(); ++i)
     {
-        auto   EFGv   = m_faces(i)->EFG();
-        auto   LMNv   = m_faces(i)->LMN();
+        getFaceDiagnostics(i, diag);
+        auto   EFGv   = diag.EFG;
+        auto   LMNv   = diag.LMN;
         auto   UVv    = m_faces(i)->coordinates();
-        double Es  = m_faces(i)->stretchingEnergyContentDensity();
-		double Eb  = m_faces(i)->bendingEnergyContentDensity();
-		double Eg  = m_faces(i)->connectionEnergyContentDensity();
+        double Es  = diag.stretchingDensity;
+		double Eb  = diag.bendingDensity;
+		double Eg  = diag.connectionDensity;
 
         a_face->write(i);        a_face->tab();
         a_face->write(UVv(0));   a_face->tab();
@@ -1078,6 +1958,8 @@ void NonEuclideanShell::DumpFormsTextFormat(TextFileHandle* a_face)
 }
 /* ============================================================================== */
 /* I/O of state and force. Needed for external optimization procedure */
+/* Only the nodes that actually move are flagged (see markNodeMoved), until    */
+/* all faces are dirty                                                           */
 void NonEuclideanShell::setPositionVector(const double *ptr)
 {
 	int j = 0;
@@ -1085,9 +1967,14 @@ void NonEuclideanShell::setPositionVector(const double *ptr)
 	{
 		if (m_nodes(i)->fixed()==-2)
 		{
-			m_nodes(i)->position(0) = ptr[3*j];
-			m_nodes(i)->position(1) = ptr[3*j+1];
-			m_nodes(i)->position(2) = ptr[3*j+2];
+			TinyVector<double,3>& r = m_nodes(i)->position();
+			if (m_allFacesDirty || r(0) != ptr[3*j] || r(1) != ptr[3*j+1] || r(2) != ptr[3*j+2])
+			{
+				r(0) = ptr[3*j];
+				r(1) = ptr[3*j+1];
+				r(2) = ptr[3*j+2];
+				markNodeMoved(i);
+			}
 			j += 1;
 		}
 	}
@@ -1097,40 +1984,32 @@ void NonEuclideanShell::setPositionVector(const double *ptr)
 		j = m_nodes(i)->fixed();
 		if (j >= 0)
 		{
-			m_nodes(i)->position() = m_nodes(j)->position() + m_nodes(i)->offset();
+			TinyVector<double,3>  image = m_nodes(j)->position() + m_nodes(i)->offset();
+			TinyVector<double,3>& r     = m_nodes(i)->position();
+			if (m_allFacesDirty || r(0) != image(0) || r(1) != image(1) || r(2) != image(2))
+			{
+				r = image;
+				markNodeMoved(i);
+			}
 		}
 	}
+	++m_stateVersion;
 }
 
 void NonEuclideanShell::setPositionVector(const gsl_vector *a_vec)
 {
-	int j = 0;
-	for (int i=0; i<m_nodes.length(); i++)
-	{
-		if (m_nodes(i)->fixed()==-2)
-		{
-			m_nodes(i)->position(0) = gsl_vector_get(a_vec,3*j);
-			m_nodes(i)->position(1) = gsl_vector_get(a_vec,3*j+1);
-			m_nodes(i)->position(2) = gsl_vector_get(a_vec,3*j+2);
-			j += 1;
-		}
-	}
-
-	for (int i=0; i<m_nodes.length(); i++)
-	{
-		j = m_nodes(i)->fixed();
-		if (j >= 0)
-		{
-			m_nodes(i)->position() = m_nodes(j)->position() + m_nodes(i)->offset();
-		}
-	}
+	setPositionVector(gsl_vector_const_ptr(a_vec, 0));
 }
 /* ============================================================================== */
 /* I/O of state and force. Needed for external optimization procedure */
 void NonEuclideanShell::getPositionVector(gsl_vector *a_vec)
+{
+	getPositionVector(gsl_vector_ptr(a_vec, 0));
+}
+
+void NonEuclideanShell::getPositionVector(double *ptr)
 {
 	int j = 0;
-	double* ptr = gsl_vector_ptr(a_vec, 0);
 	for (int i=0; i<m_nodes.length(); i++)
 	{
 		if (m_nodes(i)->fixed()==-2)
@@ -1145,60 +2024,383 @@ void NonEuclideanShell::getPositionVector(gsl_vector *a_vec)
 /* ============================================================================== */
 /* return the energy given an array containing the position */
 double NonEuclideanShell::getEnergy(const gsl_vector *a_vec)
+{
+	return getEnergy(gsl_vector_const_ptr(a_vec, 0));
+}
+
+double NonEuclideanShell::getEnergy(const double *a_state)
 {
 	if (m_verbosity>3)  Errors::StepIn("NonEuclideanShell::getEnergy()");
 
-	const double* ptr = gsl_vector_const_ptr(a_vec, 0);
-	setPositionVector(ptr);
+	setPositionVector(a_state);
 	return energy();
 }
 /* ============================================================================== */
 /* return the energy gradient given an array containing the position */
 void NonEuclideanShell::getEnergyGradient(const gsl_vector *a_state, gsl_vector *a_gradient)
+{
+	getEnergyGradient(gsl_vector_const_ptr(a_state, 0), gsl_vector_ptr(a_gradient, 0));
+}
+
+void NonEuclideanShell::getEnergyGradient(const double *a_state, double *a_gradient)
 {
 	if (m_verbosity>3)  Errors::StepIn("NonEuclideanShell::getEnergyGradient()");
 
-	const double* ptr     = gsl_vector_const_ptr(a_state, 0);
-	double*       ret_ptr = gsl_vector_ptr(a_gradient, 0);
-	setPositionVector(ptr);
+	setPositionVector(a_state);
 	initializeForce();
 	setForce();
+	gatherForce(a_gradient);
+	updatePrecision(a_gradient);
+}
+/* ============================================================================== */
+/* return the energy and its gradient given an array containing the position */
+void NonEuclideanShell::getEnergyAndEnergyGradient(const gsl_vector *a_state,
+								  double *a_energy, gsl_vector *a_gradient)
+{
+	getEnergyAndEnergyGradient(gsl_vector_const_ptr(a_state, 0), a_energy, gsl_vector_ptr(a_gradient, 0));
+}
 
-	int j = 0;
-	for (int i=0; i<m_nodes.length(); i++)
+void NonEuclideanShell::getEnergyAndEnergyGradient(const double *a_state,
+								  double *a_energy, double *a_gradient)
+{
+	if (m_verbosity>3)  Errors::StepIn("NonEuclideanShell::getEnergyAndEnergyGradient()");
+
+	setPositionVector(a_state);
+	initializeForce();
+	setForce();
+	gatherForce(a_gradient);
+	*a_energy = energy();
+	updatePrecision(a_gradient);
+}
+/* ============================================================================== */
+/* Hessian-vector product: (g(x+h d) - g(x-h d)) / 2h, with h chosen such that no  */
+/* coordinate moves by more than 1e-4 (the gradient itself is a difference with   */
+/* step 1e-6, so the product is accurate to a few digits, enough for Newton-CG)   */
+void NonEuclideanShell::getHessianVectorProduct(const double *a_state, const double *a_direction,
+												double *a_product)
+{
+	if (m_verbosity>3)  Errors::StepIn("NonEuclideanShell::getHessianVectorProduct()");
+
+	int size = SizeOfOptimizationProblem();
+	if (m_hessianState.length() != size)
 	{
-		j = m_nodes(i)->fixed();
-		if (j >= 0)
+		m_hessianState    = Vector<double>(size);
+		m_hessianGradient = Vector<double>(size);
+	}
+	double* xh = m_hessianState.getPointer();
+	double* gh = m_hessianGradient.getPointer();
+
+	double dmax = 0.0;
+	for (int i=0; i<size; i++) dmax = max(dmax, fabs(a_direction[i]));
+	if (dmax == 0.0)
+	{
+		for (int i=0; i<size; i++) a_product[i] = 0.0;
+		setPositionVector(a_state);
+		return;
+	}
+	double h = 1.e-4 / dmax;
+
+	for (int i=0; i<size; i++) xh[i] = a_state[i] + h*a_direction[i];
+	getEnergyGradient(xh, a_product);
+	for (int i=0; i<size; i++) xh[i] = a_state[i] - h*a_direction[i];
+	getEnergyGradient(xh, gh);
+	for (int i=0; i<size; i++) a_product[i] = 0.5*(a_product[i] - gh[i])/h;
+
+	setPositionVector(a_state);
+}
+/* ============================================================================== */
+/* Fill the values of the sparse Hessian at a_state. The local Hessians of the   */
+/* faces of one color are computed concurrently, then added serially (periodic   */
+/* images may map two faces of a color to the same rows).                        */
+void NonEuclideanShell::assembleHessian(const double *a_state)
+{
+	if (m_verbosity>3)  Errors::StepIn("NonEuclideanShell::assembleHessian()");
+
+	Profiler::ScopedTimer timer(Profiler::Hessian);
+
+	/* The pattern is built on first use (about 1 KB per face), see releaseHessian() */
+	if (m_hessianRowStart.length() == 0) buildHessianPattern();
+
+	setPositionVector(a_state);
+	for (int k=0; k<m_hessianValue.length(); k++) m_hessianValue(k) = 0.0;
+
+	int numberColors = m_forceColorStart.length() - 1;
+	for (int c=0; c<=numberColors; c++)
+	{
+		int  first    = m_forceColorStart(c);
+		int  last     = (c < numberColors) ? m_forceColorStart(c+1) : m_faces.length();
+		bool parallel = (c < numberColors);
+		if (m_faceHessian.length() < 324*(last-first))
+			m_faceHessian = Vector<double>(324*(last-first));
+		double* local = m_faceHessian.getPointer();
+
+		#pragma omp parallel for schedule(static) if (parallel)
+		for (int k=first; k<last; k++)
+			m_faces(m_forceOrder(k))->setHessian(local + 324*(k-first));
+
+		for (int k=first; k<last; k++)
 		{
-			m_nodes(j)->force() += m_nodes(i)->force();
+			int           f = m_forceOrder(k);
+			const double* h = local + 324*(k-first);
+			for (int a=0; a<6; a++)
+			{
+				int na = m_faceNodeIndex(6*f+a);
+				if (na < 0 || m_nodeDof(na) < 0) continue;
+				for (int b=0; b<6; b++)
+				{
+					int slot = m_hessianSlot(36*f+6*a+b);
+					if (slot < 0) continue;
+					for (int p=0; p<3; p++)
+					{
+						double* row = m_hessianValue.getPointer() + m_hessianRowStart(m_nodeDof(na)+p) + 3*slot;
+						for (int q=0; q<3; q++) row[q] += h[18*(3*a+p) + 3*b+q];
+					}
+				}
+			}
 		}
 	}
+}
 
-	j = 0;
-	for (int i=0; i<m_nodes.length(); i++)
+/* ============================================================================== */
+/* Free the pattern and the values of the sparse Hessian */
+void NonEuclideanShell::releaseHessian()
+{
+	m_hessianRowStart = Vector<int>();
+	m_hessianColumn   = Vector<int>();
+	m_hessianValue    = Vector<double>();
+	m_hessianSlot     = Vector<int>();
+	m_faceHessian     = Vector<double>();
+}
+
+/* ============================================================================== */
+/* Nonlinear Gauss-Seidel sweeps over the free nodes, color by color */
+double NonEuclideanShell::relaxLocally(int a_sweeps, const std::vector<char> *a_mask)
+{
+	if (m_verbosity>3)  Errors::StepIn("NonEuclideanShell::relaxLocally()");
+
+	double            decrease     = 0.0;
+	int               numberColors = m_relaxColorStart.length() - 1;
+	std::vector<char> moved(m_relaxOrder.length(), 0);
+	for (int s=0; s<a_sweeps; s++)
 	{
-		if (m_nodes(i)->fixed()==-2)
+		for (int c=0; c<=numberColors; c++)
 		{
-			ret_ptr[3*j]   = m_nodes(i)->force(0);
-			ret_ptr[3*j+1] = m_nodes(i)->force(1);
-			ret_ptr[3*j+2] = m_nodes(i)->force(2);
-			j += 1;
+			int    first         = m_relaxColorStart(c);
+			int    last          = (c < numberColors) ? m_relaxColorStart(c+1) : m_relaxOrder.length();
+			bool   parallel      = (c < numberColors);
+			double colorDecrease = 0.0;
+
+			#pragma omp parallel for schedule(dynamic,16) reduction(+:colorDecrease) if (parallel)
+			for (int k=first; k<last; k++)
+			{
+				int A = m_relaxOrder(k);
+				if (a_mask != NULL && !(*a_mask)[m_freeNodes(m_freeNodeStart(A))]) continue;
+				double d = relaxNode(A);
+				if (d > 0.0) moved[A] = 1;
+				colorDecrease += d;
+			}
+			decrease += colorDecrease;
 		}
 	}
+
+	for (int A=0; A<(int)moved.size(); A++)
+		if (moved[A])
+			for (int k=m_freeNodeStart(A); k<m_freeNodeStart(A+1); k++) markNodeMoved(m_freeNodes(k));
+	++m_stateVersion;
+	return decrease;
 }
+
 /* ============================================================================== */
-/* return the energy and its gradient given an array containing the position */
-void NonEuclideanShell::getEnergyAndEnergyGradient(const gsl_vector *a_state,
-								  double *a_energy, gsl_vector *a_gradient)
+/* One local Newton step (3x3 finite difference Hessian of the local energy),    */
+/* steepest descent if that Hessian is not positive definite, with backtracking. */
+/* The node stays put unless its local energy decreases.                         */
+double NonEuclideanShell::relaxNode(int a_free)
 {
-	if (m_verbosity>3)  Errors::StepIn("NonEuclideanShell::getEnergyAndEnergyGradient()");
+	const double ep      = 1.e-4;
+	const double maxStep = 0.1;
 
-	const double* ptr     = gsl_vector_const_ptr(a_state, 0);
-	double*       ret_ptr = gsl_vector_ptr(a_gradient, 0);
-	setPositionVector(ptr);
-	initializeForce();
-	setForce();
+	TinyVector<double,3> base = m_nodes(m_freeNodes(m_freeNodeStart(a_free)))->position();
+	double shift[3] = {0.0, 0.0, 0.0};
+
+	double E0 = localEnergy(a_free);
+	double g[3];
+	TinyMatrix<double,3> H;
+	for (int p=0; p<3; p++)
+	{
+		shift[p] = ep;
+		moveFreeNode(a_free, base, shift);
+		double Eplus = localEnergy(a_free);
+		shift[p] = -ep;
+		moveFreeNode(a_free, base, shift);
+		double Eminus = localEnergy(a_free);
+		shift[p] = 0.0;
+
+		g[p]   = 0.5*(Eplus - Eminus)/ep;
+		H(p,p) = (Eplus - 2.0*E0 + Eminus)/(ep*ep);
+	}
+	for (int p=0; p<3; p++)
+		for (int q=p+1; q<3; q++)
+		{
+			double E4[4];
+			for (int k=0; k<4; k++)
+			{
+				shift[p] = (k < 2)    ? ep : -ep;
+				shift[q] = (k%2 == 0) ? ep : -ep;
+				moveFreeNode(a_free, base, shift);
+				E4[k] = localEnergy(a_free);
+			}
+			shift[p] = shift[q] = 0.0;
+			H(p,q) = H(q,p) = 0.25*(E4[0] - E4[1] - E4[2] + E4[3])/(ep*ep);
+		}
+
+	double step[3];
+	double minor2 = H(0,0)*H(1,1) - H(0,1)*H(1,0);
+	if (H(0,0) > 0.0 && minor2 > 0.0 && H.det() > 0.0)
+	{
+		TinyMatrix<double,3> Hinv = H.inverse();
+		for (int p=0; p<3; p++) step[p] = -(Hinv(p,0)*g[0] + Hinv(p,1)*g[1] + Hinv(p,2)*g[2]);
+	}
+	else
+	{
+		double curvature = max(fabs(H(0,0)), max(fabs(H(1,1)), fabs(H(2,2))));
+		for (int p=0; p<3; p++) step[p] = (curvature > 0.0) ? -g[p]/curvature : -g[p];
+	}
+
+	double length = sqrt(step[0]*step[0] + step[1]*step[1] + step[2]*step[2]);
+	if (length > maxStep)
+		for (int p=0; p<3; p++) step[p] *= maxStep/length;
+
+	for (int t=0; t<8; t++)
+	{
+		moveFreeNode(a_free, base, step);
+		double E = localEnergy(a_free);
+		if (E < E0) return E0 - E;
+		for (int p=0; p<3; p++) step[p] *= 0.5;
+	}
+
+	moveFreeNode(a_free, base, shift);
+	return 0.0;
+}
 
+/* ============================================================================== */
+/* Energy of the faces that depend on a free node */
+double NonEuclideanShell::localEnergy(int a_free) const
+{
+	switch (m_activeTerms)
+	{
+		case StretchingTerm:         return localEnergyTerms<StretchingTerm>(a_free);
+		case StretchingBendingTerms: return localEnergyTerms<StretchingBendingTerms>(a_free);
+		default:                     return localEnergyTerms<AllTerms>(a_free);
+	}
+}
+
+template <int t_terms>
+double NonEuclideanShell::localEnergyTerms(int a_free) const
+{
+	double E = 0.0;
+	for (int k=m_freeFaceStart(a_free); k<m_freeFaceStart(a_free+1); k++)
+		E += m_faces(m_freeFaces(k))->energyKernel<t_terms>();
+	return E;
+}
+
+/* ============================================================================== */
+/* Move a free node, its periodic images follow (as in setPositionVector) */
+void NonEuclideanShell::moveFreeNode(int a_free, const TinyVector<double,3> &a_base, const double *a_shift)
+{
+	Node* master = m_nodes(m_freeNodes(m_freeNodeStart(a_free)));
+	for (int d=0; d<3; d++) master->position(d) = a_base(d) + a_shift[d];
+
+	for (int k=m_freeNodeStart(a_free)+1; k<m_freeNodeStart(a_free+1); k++)
+	{
+		Node* image = m_nodes(m_freeNodes(k));
+		image->position() = master->position() + image->offset();
+	}
+}
+
+/* ============================================================================== */
+/* Per-node stretching stiffness, accumulated from the faces (periodic images on  */
+/* their masters), regularized and inverted. Stretching has no stiffness normal   */
+/* to the surface, hence the shift by the mean eigenvalue (smaller shifts over-    */
+/* amplify the soft bending directions and slow L-BFGS down).                     */
+void NonEuclideanShell::buildPreconditioner()
+{
+	if (m_verbosity>3)  Errors::StepIn("NonEuclideanShell::buildPreconditioner()");
+
+	int numberFree = m_numberFreeNodes;
+	std::vector< TinyMatrix<double,3> > block(numberFree);
+
+	for (int f=0; f<m_faces.length(); f++)
+	{
+		TinyMatrix<double,3> faceBlocks[3];
+		m_faces(f)->stretchingStiffness(faceBlocks);
+		for (int i=0; i<3; i++)
+		{
+			int dof = m_nodeDof(m_faceNodeIndex(6*f+i));
+			if (dof >= 0) block[dof/3] += faceBlocks[i];
+		}
+	}
+
+	m_preconditioner = Vector<double>(9*numberFree);
+	for (int A=0; A<numberFree; A++)
+	{
+		TinyMatrix<double,3> inv;
+		double shift = block[A].trace() / 3.0;
+		if (shift > 0.0)
+		{
+			for (int p=0; p<3; p++) block[A](p,p) += shift;
+			inv = block[A].inverse();
+		}
+		else
+		{
+			for (int p=0; p<3; p++) inv(p,p) = 1.0;
+		}
+		for (int p=0; p<3; p++)
+			for (int q=0; q<3; q++)
+				m_preconditioner(9*A+3*p+q) = inv(p,q);
+	}
+
+	m_preconditionerVersion = m_parameterVersion;
+}
+
+/* ============================================================================== */
+/* Apply the inverse of the block-Jacobi preconditioner */
+void NonEuclideanShell::applyPreconditioner(const double *a_vector, double *a_result)
+{
+	if (m_preconditioner.length() == 0 || m_preconditionerVersion != m_parameterVersion)
+		buildPreconditioner();
+
+	int numberFree = m_preconditioner.length() / 9;
+	for (int A=0; A<numberFree; A++)
+	{
+		/* a_result may be a_vector */
+		const double* inv = m_preconditioner.getPointer() + 9*A;
+		double v0 = a_vector[3*A], v1 = a_vector[3*A+1], v2 = a_vector[3*A+2];
+		for (int p=0; p<3; p++)
+			a_result[3*A+p] = inv[3*p]*v0 + inv[3*p+1]*v1 + inv[3*p+2]*v2;
+	}
+}
+
+/* ============================================================================== */
+/* Product of the assembled Hessian with a vector */
+void NonEuclideanShell::hessianMultiply(const double *a_vector, double *a_product) const
+{
+	int rows = m_hessianRowStart.length() - 1;
+
+	#pragma omp parallel for schedule(static)
+	for (int i=0; i<rows; i++)
+	{
+		double sum = 0.0;
+		for (int k=m_hessianRowStart(i); k<m_hessianRowStart(i+1); k++)
+			sum += m_hessianValue(k) * a_vector[m_hessianColumn(k)];
+		a_product[i] = sum;
+	}
+}
+
+/* ============================================================================== */
+/* Fold the forces of periodic images onto their masters and copy the forces */
+/* of the free nodes into an array */
+void NonEuclideanShell::gatherForce(double *ret_ptr)
+{
 	int j = 0;
 	for (int i=0; i<m_nodes.length(); i++)
 	{
@@ -1220,7 +2422,6 @@ void NonEuclideanShell::getEnergyAndEnergyGradient(const gsl_vector *a_state,
 			j += 1;
 		}
 	}
-	*a_energy = energy();
 }
 /* ============================================================================== */
 /* return the energy gradient given an array containing the position, Full calculation */
@@ -1228,32 +2429,13 @@ void NonEuclideanShell::getEnergyGradientFull(const gsl_vector *a_state, gsl_vec
 {
 	if (m_verbosity>3)  Errors::StepIn("NonEuclideanShell::getEnergyGradientFull()");
 
-	const double* ptr     = gsl_vector_const_ptr(a_state, 0);
-	double*       ret_ptr = gsl_vector_ptr(a_gradient, 0);
-	setPositionVector(ptr);
-	double ep    = 1.e-6;
-	double Einit = energy();
-	int j = 0;
-
-	for (int i=0; i<m_nodes.length(); i++)
-	{
-		if (m_nodes(i)->fixed()==-2)
-		{
-			for (int comp=0; comp<3; comp++)
-			{
-				m_nodes(i)->position(comp) += ep;
-				double Eplus = energy();
-				m_nodes(i)->position(comp) -= 2*ep;
-				double Eminus = energy();
-				ret_ptr[3*j+comp] = 0.5*(Eplus-Eminus)/ep;
-				m_nodes(i)->position(comp) += ep;
-			}
-			j += 1;
-		}
-	}
+	double energy;
+	getEnergyAndEnergyGradientFull(a_state, &energy, a_gradient);
 }
 /* ============================================================================== */
-/* return the energy and its gradient given an array containing the position, Full calculation */
+/* return the energy and its gradient given an array containing the position, Full calculation. */
+/* Central differences of energy(): every free node is moved with its periodic images, and     */
+/* flagged so that the cached face energies around it are re-evaluated                          */
 void NonEuclideanShell::getEnergyAndEnergyGradientFull(const gsl_vector *a_state,
 								  double *a_energy, gsl_vector *a_gradient)
 {
@@ -1262,85 +2444,233 @@ void NonEuclideanShell::getEnergyAndEnergyGradientFull(const gsl_vector *a_state
 	const double* ptr     = gsl_vector_const_ptr(a_state, 0);
 	double*       ret_ptr = gsl_vector_ptr(a_gradient, 0);
 	setPositionVector(ptr);
-	double ep    = 1.e-6;
-	double Einit = energy();
-	int j = 0;
+	double ep = 1.e-6;
 
-	for (int i=0; i<m_nodes.length(); i++)
+	for (int A=0; A<m_numberFreeNodes; A++)
 	{
-		if (m_nodes(i)->fixed()==-2)
+		TinyVector<double,3> base = m_nodes(m_freeNodes(m_freeNodeStart(A)))->position();
+		double shift[3] = {0.0, 0.0, 0.0};
+		double E[2];
+		for (int comp=0; comp<3; comp++)
 		{
-			for (int comp=0; comp<3; comp++)
+			for (int m=0; m<2; m++)
 			{
-				m_nodes(i)->position(comp) += ep;
-				double Eplus = energy();
-				m_nodes(i)->position(comp) -= 2*ep;
-				double Eminus = energy();
-				ret_ptr[3*j+comp] = 0.5*(Eplus-Eminus)/ep;
-				m_nodes(i)->position(comp) += ep;
+				shift[comp] = (m == 0) ? ep : -ep;
+				moveFreeNode(A, base, shift);
+				for (int k=m_freeNodeStart(A); k<m_freeNodeStart(A+1); k++) markNodeMoved(m_freeNodes(k));
+				E[m] = energy();
 			}
-			j += 1;
+			shift[comp] = 0.0;
+			ret_ptr[3*A+comp] = 0.5*(E[0]-E[1])/ep;
 		}
+		moveFreeNode(A, base, shift);
+		for (int k=m_freeNodeStart(A); k<m_freeNodeStart(A+1); k++) markNodeMoved(m_freeNodes(k));
 	}
 	*a_energy = energy();
 }
 
 /* ============================================================================== */
-/* Test the gradient calculation                                                 */
-void NonEuclideanShell::testGradient()
+/* Largest difference of the Full gradient and the assembled one at the current */
+/* state, relative to the largest entry of the assembled gradient               */
+double NonEuclideanShell::testGradientFull()
+{
+	int size = SizeOfOptimizationProblem();
+	if (size == 0) return 0.0;
+
+	gsl_vector* x    = gsl_vector_alloc(size);
+	gsl_vector* full = gsl_vector_alloc(size);
+	std::vector<double> gradient(size);
+	getPositionVector(x);
+	getEnergyGradient(gsl_vector_const_ptr(x, 0), &gradient[0]);
+	getEnergyGradientFull(x, full);
+
+	double difference = 0.0, largest = 0.0;
+	for (int i=0; i<size; i++)
+	{
+		difference = max(difference, fabs(gsl_vector_get(full, i) - gradient[i]));
+		largest    = max(largest, fabs(gradient[i]));
+	}
+	double error = (largest > 0.0) ? difference/largest : difference;
+	std::cout << "NonEuclideanShell::testGradientFull()   largest difference " << difference
+			  << " (relative " << error << ")" << std::endl;
+
+	setPositionVector(gsl_vector_const_ptr(x, 0));
+	gsl_vector_free(x);
+	gsl_vector_free(full);
+	return error;
+}
+
+/* ============================================================================== */
+/* Test the gradient calculation                                                  */
+/* ============================================================================== */
+/* Uniform random numbers in [0,1) from a seed (splitmix64), independent of rand() */
+static double uniformRandom(unsigned long long &a_state)
 {
-	int    noDOF = SizeOfOptimizationProblem();
-	double grad[noDOF], gradFull[noDOF];
+	unsigned long long z = (a_state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	z ^= z >> 31;
+	return (z >> 11) * (1.0/9007199254740992.0);
+}
 
-	/* calculate force */
-	initializeForce();
-	setForce();
-	int j = 0;
+/* Relative difference of a derivative and its finite difference estimate, with */
+/* a floor for derivatives that are small on the scale of the gradient          */
+static double relativeError(double a_derivative, double a_estimate, double a_floor)
+{
+	double scale = max(max(fabs(a_derivative), fabs(a_estimate)), a_floor);
+	return (scale > 0.0) ? fabs(a_derivative - a_estimate) / scale : 0.0;
+}
 
-	for (int i=0; i<m_nodes.length(); i++)
+/* Richardson extrapolation of central differences with steps h and h/2 */
+static double richardson(double a_plus, double a_minus, double a_halfPlus, double a_halfMinus, double a_h)
+{
+	double D1 = 0.5*(a_plus - a_minus)/a_h;
+	double D2 = (a_halfPlus - a_halfMinus)/a_h;
+	return (4.0*D2 - D1)/3.0;
+}
+
+/* ============================================================================== */
+/* Sampled gradient check: directional derivatives from full energies, partial */
+/* derivatives from the energy of the faces of one free node                   */
+double NonEuclideanShell::testGradient(int a_directions, int a_components, unsigned int a_seed, double a_step)
+{
+	int size = SizeOfOptimizationProblem();
+	if (size == 0) return 0.0;
+
+	/* Check the double precision functional; the state and the terms are restored at the end */
+	EnergyTerms savedTerms = m_activeTerms;
+	bool        savedMixed = m_mixedPrecision;
+	m_mixedPrecision = false;
+
+	std::vector<double> x(size), xp(size), direction(size);
+	getPositionVector(&x[0]);
+	setPositionVector(&x[0]);
+
+	/* Step: a_step times the mean edge length */
+	double length = 0.0;
+	int    numberEdges = numberOfEdges();
+	for (int e=0; e<numberEdges; e++)
+		length += (m_nodes(m_edgeNode(2*e))->coordinates() - m_nodes(m_edgeNode(2*e+1))->coordinates()).norm();
+	double h = a_step * ((numberEdges > 0) ? length/numberEdges : 1.0);
+
+	/* Random directions (entries in [-1,1]) and coordinates */
+	unsigned long long  random = a_seed;
+	std::vector<double> directions((size_t)a_directions*size);
+	std::vector<int>    components(a_components);
+	for (size_t k=0; k<directions.size(); k++) directions[k] = 2.0*uniformRandom(random) - 1.0;
+	for (int k=0; k<a_components; k++) components[k] = min((int)(uniformRandom(random)*size), size-1);
+
+	/* Assembled gradient, directional and partial derivatives and their estimates, for the */
+	/* functionals with 1, 2 and 3 terms; the terms themselves are the differences          */
+	int numberLevels = (int)savedTerms;
+	std::vector<double> gradient(size);
+	std::vector<double> derivative(numberLevels*(a_directions + a_components));
+	std::vector<double> estimate(numberLevels*(a_directions + a_components));
+	std::vector<double> scale(numberLevels*(a_directions + a_components));
+	for (int l=0; l<numberLevels; l++)
 	{
-		if (m_nodes(i)->fixed()==-2)
+		m_activeTerms = EnergyTerms(l+1);
+		touchState();
+
+		setPositionVector(&x[0]);
+		initializeForce();
+		setForce();
+		gatherForce(&gradient[0]);
+		double gmax = 0.0;
+		for (int i=0; i<size; i++) gmax = max(gmax, fabs(gradient[i]));
+
+		double* D = &derivative[l*(a_directions + a_components)];
+		double* R = &estimate[l*(a_directions + a_components)];
+		double* S = &scale[l*(a_directions + a_components)];
+
+		/* Directions: full energies at x + s h d, s = 1, -1, 1/2, -1/2 */
+		for (int k=0; k<a_directions; k++)
 		{
-			grad[3*j]   = m_nodes(i)->force(0);
-			grad[3*j+1] = m_nodes(i)->force(1);
-			grad[3*j+2] = m_nodes(i)->force(2);
-			j += 1;
-		}
-	}
+			const double* d = &directions[(size_t)k*size];
+			double E[4];
+			const double s[4] = {1.0, -1.0, 0.5, -0.5};
+			for (int m=0; m<4; m++)
+			{
+				for (int i=0; i<size; i++) xp[i] = x[i] + s[m]*h*d[i];
+				E[m] = getEnergy(&xp[0]);
+			}
+			setPositionVector(&x[0]);
 
-	j = 0;
+			D[k] = 0.0;
+			S[k] = 0.0;
+			for (int i=0; i<size; i++)
+			{
+				D[k] += gradient[i]*d[i];
+				S[k] += fabs(gradient[i]*d[i]);
+			}
+			R[k] = richardson(E[0], E[1], E[2], E[3], h);
+		}
 
-	/* calculate force directly */
-	double ep    = 1.e-6;
-	for (int i=0; i<m_nodes.length(); i++)
-	{
-		if (m_nodes(i)->fixed()==-2)
+		/* Coordinates: energies of the faces of the free node only */
+		for (int k=0; k<a_components; k++)
 		{
-			for (int comp=0; comp<3; comp++)
+			int A = components[k]/3, p = components[k]%3;
+			TinyVector<double,3> base = m_nodes(m_freeNodes(m_freeNodeStart(A)))->position();
+			double E[4];
+			const double s[4] = {1.0, -1.0, 0.5, -0.5};
+			for (int m=0; m<4; m++)
 			{
-				m_nodes(i)->position(comp) += ep;
-				double Eplus = energy();
-				m_nodes(i)->position(comp) -= 2*ep;
-				double Eminus = energy();
-				gradFull[3*j+comp] = 0.5*(Eplus-Eminus)/ep;
-				m_nodes(i)->position(comp) += ep;
+				double shift[3] = {0.0, 0.0, 0.0};
+				shift[p] = s[m]*h;
+				moveFreeNode(A, base, shift);
+				E[m] = localEnergy(A);
 			}
-			j += 1;
+			double shift[3] = {0.0, 0.0, 0.0};
+			moveFreeNode(A, base, shift);
+
+			D[a_directions+k] = gradient[components[k]];
+			R[a_directions+k] = richardson(E[0], E[1], E[2], E[3], h);
+			S[a_directions+k] = gmax;
 		}
 	}
 
-	/* output */
-	for (int i=0; i<noDOF; i++)
+	/* Per term relative errors, relative to 1e-6 of the size of the terms of the dot */
+	/* product or of the largest gradient entry at least                               */
+	const char* termName[3] = {"stretching", "bending", "connection"};
+	double      worst = 0.0;
+	std::cout << "NonEuclideanShell::testGradient()   " << a_directions << " directions, " << a_components
+			  << " coordinates, step " << h << std::endl;
+	for (int l=0; l<numberLevels; l++)
 	{
-		// std::cout << grad[i] << " " << gradFull[i] << " " <<  fabs(gradFull[i]-grad[i]) << std::endl;
-		std::cout << grad[i] << " " << gradFull[i] << " " << fabs(gradFull[i]-grad[i])
-          << " " << (fabs(gradFull[i]) > 1e-10 ? fabs(gradFull[i]-grad[i])/fabs(gradFull[i]) : 0.0)
-          << std::endl;	
-
+		int     stride = a_directions + a_components;
+		double* D  = &derivative[l*stride];
+		double* R  = &estimate[l*stride];
+		double* D0 = (l > 0) ? &derivative[(l-1)*stride] : NULL;
+		double* R0 = (l > 0) ? &estimate[(l-1)*stride]   : NULL;
+		double* S  = &scale[l*stride];
+
+		double directional = 0.0, partial = 0.0;
+		for (int k=0; k<stride; k++)
+		{
+			double d = D0 ? D[k] - D0[k] : D[k];
+			double r = R0 ? R[k] - R0[k] : R[k];
+			double e = relativeError(d, r, 1e-6*S[k]);
+			if (k < a_directions) directional = max(directional, e);
+			else                  partial     = max(partial,     e);
+		}
+		worst = max(worst, max(directional, partial));
+		std::cout << "NonEuclideanShell::testGradient()   " << std::setw(10) << std::left << termName[l] << std::right
+				  << "  directional " << std::scientific << std::setprecision(2) << directional
+				  << "  coordinates " << partial << std::endl;
+		std::cout.unsetf(std::ios::floatfield);
+		std::cout << std::setprecision(6);
 	}
 
+	/* Restore */
+	m_activeTerms    = savedTerms;
+	m_mixedPrecision = savedMixed;
+	touchState();
+	setPositionVector(&x[0]);
 
-	}
+	return worst;
+}
+
+/* ============================================================================== */
 	const Vector<Face*>& NonEuclideanShell::getFaces() const {
 		return m_faces;
 	}
@@ -0,0 +1,124 @@
+/*
+ *  PerfCounters.cpp
+ *  RKLibrary
+ *
+ */
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+#include "PerfCounters.H"
+
+
+/* ============================================================================== */
+/* Constructor */
+PerfCounters::PerfCounters() :
+m_available(false),
+m_reason("not opened")
+{
+	for (int e=0; e<NumberOfEvents; e++) m_fd[e] = -1;
+}
+
+/* ============================================================================== */
+/* Destructor */
+PerfCounters::~PerfCounters()
+{
+	close();
+}
+
+/* ============================================================================== */
+/* Open the counters */
+bool PerfCounters::open()
+{
+	close();
+
+#ifdef __linux__
+	const unsigned int type[NumberOfEvents] =
+		{PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+	const unsigned long long config[NumberOfEvents] =
+		{PERF_COUNT_HW_CPU_CYCLES,
+		 PERF_COUNT_HW_INSTRUCTIONS,
+		 PERF_COUNT_HW_CACHE_MISSES,
+		 PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		 PERF_COUNT_HW_BRANCH_MISSES};
+
+	int error = 0;
+	for (int e=0; e<NumberOfEvents; e++)
+	{
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size           = sizeof(attr);
+		attr.type           = type[e];
+		attr.config         = config[e];
+		attr.exclude_kernel = 1;
+		attr.exclude_hv     = 1;
+		attr.inherit        = 1;
+		attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		/* this process, any cpu, no group */
+		m_fd[e] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (m_fd[e] < 0)
+		{
+			if (error == 0) error = errno;
+			continue;
+		}
+		m_available = true;
+	}
+
+	if (m_available)
+		m_reason = "";
+	else if (error == EACCES || error == EPERM)
+		m_reason = "perf_event_open not permitted (see /proc/sys/kernel/perf_event_paranoid)";
+	else if (error == ENOENT || error == EOPNOTSUPP)
+		m_reason = "no hardware counters (virtual machine or container?)";
+	else if (error == ENOSYS)
+		m_reason = "perf_event_open not supported by the kernel";
+	else
+		m_reason = std::string("perf_event_open failed: ") + strerror(error);
+#else
+	m_reason = "hardware counters need Linux perf_event_open";
+#endif
+
+	return m_available;
+}
+
+/* ============================================================================== */
+/* Close the counters */
+void PerfCounters::close()
+{
+#ifdef __linux__
+	for (int e=0; e<NumberOfEvents; e++)
+		if (m_fd[e] >= 0) ::close(m_fd[e]);
+#endif
+	for (int e=0; e<NumberOfEvents; e++) m_fd[e] = -1;
+	m_available = false;
+	m_reason    = "not opened";
+}
+
+/* ============================================================================== */
+/* Counts since open(), scaled by the fraction of time the event was scheduled */
+void PerfCounters::read(double *a_counts) const
+{
+	for (int e=0; e<NumberOfEvents; e++)
+	{
+		a_counts[e] = 0.0;
+#ifdef __linux__
+		unsigned long long value[3];
+		if (m_fd[e] < 0 || ::read(m_fd[e], value, sizeof(value)) != (ssize_t)sizeof(value)) continue;
+		if (value[2] == 0) continue;
+		a_counts[e] = (value[2] < value[1]) ? (double)value[0] * value[1] / value[2] : (double)value[0];
+#endif
+	}
+}
+
+/* ============================================================================== */
+/* Names in reports */
+const char* PerfCounters::name(Event a_event)
+{
+	static const char* names[NumberOfEvents] =
+		{"cycles", "instructions", "cache_misses", "l1d_read_misses", "branch_misses"};
+	return names[a_event];
+}
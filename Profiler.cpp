@@ -0,0 +1,199 @@
+/*
+ *  Profiler.cpp
+ *  RKLibrary
+ *
+ */
+
+#include "Profiler.H"
+
+bool                                   Profiler::s_enabled = false;
+Profiler::Phase                        Profiler::s_current = Profiler::Other;
+Profiler::Clock::time_point            Profiler::s_start;
+Profiler::Clock::time_point            Profiler::s_mark;
+double                                 Profiler::s_seconds[Profiler::NumberOfPhases];
+long                                   Profiler::s_calls[Profiler::NumberOfPhases];
+long                                   Profiler::s_counters[Profiler::NumberOfCounters];
+std::vector<Profiler::IterationRecord> Profiler::s_iterations;
+Profiler::Clock::time_point            Profiler::s_lastRecord;
+long                                   Profiler::s_lastCounters[Profiler::NumberOfCounters];
+PerfCounters                           Profiler::s_perf;
+double                                 Profiler::s_events[Profiler::NumberOfPhases][PerfCounters::NumberOfEvents];
+double                                 Profiler::s_lastEvents[PerfCounters::NumberOfEvents];
+
+
+/* ============================================================================== */
+/* Start (and reset) or stop profiling */
+void Profiler::enable(bool a_enable)
+{
+	if (a_enable)
+	{
+		for (int p=0; p<NumberOfPhases; p++)   {s_seconds[p] = 0.0; s_calls[p] = 0;}
+		for (int p=0; p<NumberOfPhases; p++)
+			for (int e=0; e<PerfCounters::NumberOfEvents; e++) s_events[p][e] = 0.0;
+		if (s_perf.available()) s_perf.read(s_lastEvents);
+		for (int c=0; c<NumberOfCounters; c++) {s_counters[c] = 0; s_lastCounters[c] = 0;}
+		s_iterations.clear();
+		s_current    = Other;
+		s_start      = Clock::now();
+		s_mark       = s_start;
+		s_lastRecord = s_start;
+	}
+	else if (s_enabled)
+	{
+		switchTo(Other);
+		s_perf.close();
+	}
+	s_enabled = a_enable;
+}
+
+/* ============================================================================== */
+/* Start the hardware counters */
+bool Profiler::enableHardwareCounters()
+{
+	if (!s_enabled) return false;
+
+	switchTo(s_current);
+	if (!s_perf.open()) return false;
+	s_perf.read(s_lastEvents);
+	return true;
+}
+
+/* ============================================================================== */
+/* Switch phase */
+Profiler::Phase Profiler::switchTo(Phase a_phase)
+{
+	Clock::time_point now = Clock::now();
+	s_seconds[s_current] += std::chrono::duration<double>(now - s_mark).count();
+	s_mark = now;
+
+	if (s_perf.available())
+	{
+		double events[PerfCounters::NumberOfEvents];
+		s_perf.read(events);
+		for (int e=0; e<PerfCounters::NumberOfEvents; e++)
+		{
+			s_events[s_current][e] += events[e] - s_lastEvents[e];
+			s_lastEvents[e]         = events[e];
+		}
+	}
+
+	Phase previous = s_current;
+	s_current = a_phase;
+	return previous;
+}
+
+/* ============================================================================== */
+/* Time of a phase, including the running one */
+double Profiler::seconds(Phase a_phase)
+{
+	double ret = s_seconds[a_phase];
+	if (s_enabled && a_phase == s_current)
+		ret += std::chrono::duration<double>(Clock::now() - s_mark).count();
+	return ret;
+}
+
+/* ============================================================================== */
+/* Record an optimizer iteration */
+void Profiler::recordIteration(int a_iteration, double a_energy, double a_gradientNorm)
+{
+	if (!s_enabled) return;
+
+	Clock::time_point now = Clock::now();
+	IterationRecord record;
+	record.iteration    = a_iteration;
+	record.energy       = a_energy;
+	record.gradientNorm = a_gradientNorm;
+	record.seconds      = std::chrono::duration<double>(now - s_lastRecord).count();
+	for (int c=0; c<NumberOfCounters; c++)
+	{
+		record.counters[c] = s_counters[c] - s_lastCounters[c];
+		s_lastCounters[c]  = s_counters[c];
+	}
+	s_lastRecord = now;
+	s_iterations.push_back(record);
+}
+
+/* ============================================================================== */
+/* Names in the JSON report */
+const char* Profiler::phaseName(Phase a_phase)
+{
+	static const char* names[NumberOfPhases] =
+		{"other", "setup", "formulas", "energy", "gradient", "hessian", "optimizer", "output"};
+	return names[a_phase];
+}
+
+const char* Profiler::counterName(Counter a_counter)
+{
+	static const char* names[NumberOfCounters] =
+		{"energy_calls", "gradient_calls", "face_energy_evaluations", "face_force_evaluations"};
+	return names[a_counter];
+}
+
+/* ============================================================================== */
+/* A number, or null if not finite (JSON has no inf and nan) */
+static void writeNumber(std::ostream &a_out, double a_value)
+{
+	if (std::isfinite(a_value)) a_out << a_value;
+	else                        a_out << "null";
+}
+
+/* ============================================================================== */
+/* Write the report */
+bool Profiler::writeJSON(const std::string &a_fileName)
+{
+	std::ofstream out(a_fileName.c_str());
+	if (!out) return false;
+
+	double wall = std::chrono::duration<double>(Clock::now() - s_start).count();
+	out << std::setprecision(9);
+	out << "{\n  \"wall_seconds\": " << (s_enabled ? wall : 0.0) << ",\n";
+
+	if (s_enabled) switchTo(s_current);
+	out << "  \"hardware_counters\": {\"available\": " << (s_perf.available() ? "true" : "false");
+	if (!s_perf.available()) out << ", \"reason\": \"" << s_perf.reason() << "\"";
+	out << "},\n";
+
+	out << "  \"phases\": {";
+	for (int p=0; p<NumberOfPhases; p++)
+	{
+		out << (p ? "," : "") << "\n    \"" << phaseName(Phase(p)) << "\": {\"seconds\": " << seconds(Phase(p))
+			<< ", \"calls\": " << s_calls[p];
+		if (s_perf.available())
+		{
+			out << ", \"hardware\": {";
+			for (int e=0; e<PerfCounters::NumberOfEvents; e++)
+			{
+				out << (e ? ", " : "") << "\"" << PerfCounters::name(PerfCounters::Event(e)) << "\": ";
+				if (s_perf.available(PerfCounters::Event(e))) out << s_events[p][e];
+				else                                          out << "null";
+			}
+			double cycles = s_events[p][PerfCounters::Cycles];
+			out << ", \"ipc\": ";
+			writeNumber(out, (cycles > 0.0) ? s_events[p][PerfCounters::Instructions] / cycles : 0.0);
+			out << "}";
+		}
+		out << "}";
+	}
+	out << "\n  },\n";
+
+	out << "  \"counters\": {";
+	for (int c=0; c<NumberOfCounters; c++)
+		out << (c ? "," : "") << "\n    \"" << counterName(Counter(c)) << "\": " << s_counters[c];
+	out << "\n  },\n";
+
+	out << "  \"iterations\": [";
+	for (size_t i=0; i<s_iterations.size(); i++)
+	{
+		const IterationRecord &r = s_iterations[i];
+		out << (i ? "," : "") << "\n    {\"iteration\": " << r.iteration << ", \"energy\": ";
+		writeNumber(out, r.energy);
+		out << ", \"gradient_norm\": ";
+		writeNumber(out, r.gradientNorm);
+		out << ", \"seconds\": " << r.seconds;
+		for (int c=0; c<NumberOfCounters; c++) out << ", \"" << counterName(Counter(c)) << "\": " << r.counters[c];
+		out << "}";
+	}
+	out << "\n  ]\n}\n";
+
+	return out.good();
+}
@@ -31,6 +31,13 @@ namespace fs = std::filesystem;
 #include "TinyVector.H"
 #include "TinyMatrix.H"
 #include "NonEuclideanShell.H"
+#include "ShellMinimizer.H"
+#include "LBFGSMinimizer.H"
+#include "FIREMinimizer.H"
+#include "NewtonCGMinimizer.H"
+#include "MultilevelSolver.H"
+#include "ContinuationController.H"
+#include "Profiler.H"
 #include "mathexpr.h"
 
 #include "gsl/gsl_multimin.h"
@@ -40,11 +47,6 @@ namespace fs = std::filesystem;
 
 
 
-/* forward function declarations (for optimizer) */
-double my_f  (const gsl_vector *, void *);
-void   my_df (const gsl_vector *, void *, gsl_vector *);
-void   my_fdf(const gsl_vector *, void *, double *, gsl_vector *);
-
 /* Forward declaration of input functions */
 TinyMatrix<double,2> inputFunctionAbar     (double, double);
 TinyMatrix<double,2> inputFunctionBbar     (double, double);
@@ -86,6 +88,7 @@ char* gammabar222_formula;
 TinyMatrix<TinyMatrix<double,2>,2>
 inputFunctionGammaBar(double u, double v)
 {
+    Profiler::ScopedTimer timer(Profiler::Formulas);
     RVar uvar("u",&u), vvar("v",&v);
     RVar* vars[2] = { &uvar, &vvar };
 
@@ -120,6 +123,7 @@ int main() {
 	std::string  EFGLMNOutputFileName;
 	std::string  restartFileName;
 	std::string  energyFileName;
+	std::string  profileFileName;
 	std::string  saveFileName;
 	std::string  verticesFileName;
 	std::string  facesFileName;
@@ -262,6 +266,50 @@ int main() {
 		std::cin >> restartFileName;
 	}
 
+	/* Optional settings: keyword-value pairs until the end of the input */
+	std::string minimizerName = "cg";
+	int         LBFGSMemory   = 10;
+	double      FIRETimeStep  = 0.0;
+	double      NewtonSwitch  = 0.0;
+	int         CoarseIterations = 2000;
+	double      CoarseTolerance  = 1e-5;
+	std::vector<std::string> coarseVertices, coarseFaces;
+	std::string continuationMode       = "ramp";
+	double      ContinuationTolerance  = 1e-4;
+	double      ContinuationStep       = 0.05;
+	int         ContinuationIterations = 200;
+	int         SmoothingSweeps        = 0;
+	int         Profile                = 0;
+	int         HardwareCounters       = 0;
+	std::string option;
+	while (std::cin >> option)
+	{
+		if (option == "Minimizer")			std::cin >> minimizerName;
+		else if (option == "LBFGSMemory")	std::cin >> LBFGSMemory;
+		else if (option == "FIRETimeStep")	std::cin >> FIRETimeStep;
+		else if (option == "NewtonSwitch")	std::cin >> NewtonSwitch;
+		else if (option == "CoarseMesh")	/* vertices and faces file, coarsest first */
+		{
+			std::string v, f;
+			std::cin >> v >> f;
+			coarseVertices.push_back(v);
+			coarseFaces.push_back(f);
+		}
+		else if (option == "CoarseIterations")	std::cin >> CoarseIterations;
+		else if (option == "CoarseTolerance")	std::cin >> CoarseTolerance;
+		else if (option == "Continuation")		std::cin >> continuationMode;	/* ramp or adaptive */
+		else if (option == "ContinuationTolerance")	std::cin >> ContinuationTolerance;
+		else if (option == "ContinuationStep")		std::cin >> ContinuationStep;
+		else if (option == "ContinuationIterations")	std::cin >> ContinuationIterations;
+		else if (option == "SmoothingSweeps")	std::cin >> SmoothingSweeps;	/* local relaxation before (re)starting */
+		else if (option == "Profile")			std::cin >> Profile;			/* phase timers and counters, written as JSON */
+		else if (option == "HardwareCounters")	std::cin >> HardwareCounters;	/* per phase hardware events in the profile */
+		else Errors::Warning("Unknown input option " + option);
+	}
+	if (Profile != 0 || HardwareCounters != 0) Profiler::enable(true);
+	if (HardwareCounters != 0 && !Profiler::enableHardwareCounters())
+		Errors::Warning("No hardware counters, timing only: " + Profiler::hardwareCountersReason());
+
 	/* Setting the file names */
 	// nodeOutputFileName  = verticesFileName + ".dat";
 	// faceOutputFileName  = facesFileName + ".dat";
@@ -278,6 +326,7 @@ int main() {
 
 	nodeOutputFileName   = (dir / (vStem + ".dat")).string();
 	energyFileName       = (dir / (vStem + ".energy")).string();
+	profileFileName      = (dir / (vStem + ".profile.json")).string();
 	saveFileName         = (dir / (vStem + ".save")).string();
 
 	faceOutputFileName   = (dir / (fStem + ".dat")).string();
@@ -314,6 +363,9 @@ int main() {
 
 	/* Set various parameters of the NonEuclideanShell */
 	lattice.setVerbosity(1);
+	/* per-face diagnostics for the dumps: the energyBreakdown() before each dump */
+	/* fills the buffer, energy() in the line searches does not touch it           */
+	lattice.enableDiagnostics(true);
 	// A trivial zero‐reference connection
     // // build Γ̄ from the user‐supplied formulas:
     // auto inputFunctionGammaBar = [](double u, double v) {
@@ -367,6 +419,34 @@ int main() {
 
 	lattice.setAdjust(ThicknessAdjust, MetricAdjust);
 
+	/* Multilevel warm start: relax the coarse meshes (with the final parameters) */
+	/* and interpolate the result to the lattice                                   */
+	if (!coarseVertices.empty() && restart == 0)
+	{
+		MultilevelSolver multilevel(minimizerName == "newton" ? "lbfgs" : minimizerName,
+									CoarseIterations, CoarseTolerance);
+		std::vector<NonEuclideanShell*> levels;
+		for (int l=0; l<(int)coarseVertices.size(); l++)
+		{
+			NonEuclideanShell* level = new NonEuclideanShell(coarseVertices[l], coarseFaces[l]);
+			level->setVerbosity(1);
+			level->defaultInitialization();
+			level->setParameters(&inputFunctionThickness,
+								 &inputFunctionLambda,
+								 &inputFunctionMu,
+								 &inputFunctionAbar,
+								 &inputFunctionBbar,
+								 &inputFunctionPos0,
+								 &inputFunctionGammaBar,
+								 lambdaG,
+								 muG);
+			levels.push_back(level);
+			multilevel.addLevel(level);
+		}
+		multilevel.solve(lattice);
+		for (int l=0; l<(int)levels.size(); l++) delete levels[l];
+	}
+
 	/* temporary: test the gradient */
 	// lattice.testGradient();
 	// exit(1);
@@ -377,60 +457,75 @@ int main() {
 
 	/* Calculate the initial energy and output it */
 	std::cout.precision(15);
-	std::cout << "\tThe initial bending energy is " << lattice.bendingEnergy() * pow(ThicknessAdjust * MetricAdjust, 0) << std::endl;
-	std::cout << "\tThe initial stretching energy is " << lattice.stretchingEnergy() * pow(ThicknessAdjust * MetricAdjust, 0) << std::endl;
-	std::cout << "\tThe initial connection energy is " << lattice.connectionEnergy() * pow(ThicknessAdjust * MetricAdjust, 0) << std::endl;
+	EnergyBreakdown initialEnergy = lattice.energyBreakdown();
+	std::cout << "\tThe initial bending energy is " << initialEnergy.bending * pow(ThicknessAdjust * MetricAdjust, 0) << std::endl;
+	std::cout << "\tThe initial stretching energy is " << initialEnergy.stretching * pow(ThicknessAdjust * MetricAdjust, 0) << std::endl;
+	std::cout << "\tThe initial connection energy is " << initialEnergy.connection * pow(ThicknessAdjust * MetricAdjust, 0) << std::endl;
 
 
 
 	/* The size of the optimization problem */
 	int size = lattice.SizeOfOptimizationProblem();
 
-	/* define the minimizer: we work with BFGS */
+	/* define the minimizer: conjugate gradient (GSL) unless chosen otherwise in the input */
 	// const gsl_multimin_fdfminimizer_type* method = gsl_multimin_fdfminimizer_vector_bfgs;
-	const gsl_multimin_fdfminimizer_type* method = gsl_multimin_fdfminimizer_conjugate_fr;
-	// const gsl_multimin_fdfminimizer_type* method = gsl_multimin_fdfminimizer_vector_bfgs2;
-
 	// const gsl_multimin_fdfminimizer_type* method = gsl_multimin_fdfminimizer_steepest_descent;
-	gsl_multimin_fdfminimizer*      optimizer = gsl_multimin_fdfminimizer_alloc (method, size);
-
-	/* Define the function to be minimized */
-	gsl_multimin_function_fdf my_func;
-	my_func.n      = size;
-	my_func.f      = &my_f;
-	my_func.df     = &my_df;
-	my_func.fdf    = &my_fdf;
-	my_func.params = static_cast<void *>(&lattice);
+	ShellMinimizer* optimizer = NULL;
+	if (minimizerName == "lbfgs")
+		optimizer = new LBFGSMinimizer(lattice, LBFGSMemory);
+	else if (minimizerName == "lbfgs-pc")
+		optimizer = new PreconditionedLBFGSMinimizer(lattice, LBFGSMemory);
+	else if (minimizerName == "fire")
+		optimizer = new FIREMinimizer(lattice, FIRETimeStep);
+	else
+		optimizer = ShellMinimizer::create(minimizerName, lattice);
+	if (optimizer == NULL) Errors::Abort("Unknown minimizer " + minimizerName);
+	std::cout << "\tMinimizer: " << optimizer->name() << std::endl;
 
 	/* construct the initial state */
 	gsl_vector *IC;
 	IC = gsl_vector_alloc(size);
+	if (SmoothingSweeps > 0)
+		std::cout << "\tLocal relaxation: energy decrease " << lattice.relaxLocally(SmoothingSweeps) << std::endl;
 	lattice.getPositionVector(IC);
 
-	/* set paramters of optimizer */
-	// gsl_multimin_fdfminimizer_set(optimizer, &my_func, IC, 0.01, 1e-6);
-	
-	/* set paramters of optimizer */
-	gsl_multimin_fdfminimizer_set(optimizer, &my_func, IC, 0.01, 1e-5);	
+	/* set the initial state of the optimizer (step size 0.01, tolerance 1e-5 for GSL) */
+	optimizer->set(IC);
 	
 
 
+	/* adaptive continuation in the adjustment parameters (otherwise the fixed ramp below) */
+	bool adaptive = (continuationMode == "adaptive");
+	if (!adaptive && continuationMode != "ramp") Errors::Warning("Unknown continuation " + continuationMode);
+	ContinuationController continuation(ThicknessAdjust, MetricAdjust, ContinuationTolerance,
+										ContinuationStep, ContinuationIterations);
+
 	/* the optimization loop */
 	int status;
 	int print_counter=0;
 	for (int iter=0; iter<NumberOfLoops; iter++)
 	{
-		/* set the adjustment parameters */
-		double thicknessAdjustSign = 1.0;
-		if (ThicknessAdjust < 1.0)	{thicknessAdjustSign = -1.0;}
-		// double adjustParamThickness	= 1.0 + (ThicknessAdjust - 1.0) * pow((1.0 - 5.0 * iter / NumberOfLoops),3);
-		double adjustParamThickness	= ThicknessAdjust + (1.0 - ThicknessAdjust) * pow(5.0 * iter / NumberOfLoops,3);
-		/*double adjustParamThickness	= ThicknessAdjust + (1.0 - ThicknessAdjust) * 0.5*(1 + sin(3.141592*(5.0 * iter / NumberOfLoops) - 0.727)/abs(sin(3.141592*(5.0 * iter / NumberOfLoops) - 0.727))); */
-		// double adjustParamThickness	= pow(ThicknessAdjust + (1.0 - ThicknessAdjust) * iter / NumberOfLoops,-2);//adjust wgal then calibrate
-		if (adjustParamThickness*thicknessAdjustSign < thicknessAdjustSign)	{adjustParamThickness = 1.0;}
-		double adjustParamMetric	= 1.0 + (MetricAdjust - 1.0) * (1.0 - 1.0 * iter / NumberOfLoops);
-		if (adjustParamMetric < 1)		{adjustParamMetric = 1.0;}
-		lattice.setAdjust(adjustParamThickness, adjustParamMetric);
+		double adjustParamThickness, adjustParamMetric;
+		if (adaptive)
+		{
+			adjustParamThickness = continuation.thicknessAdjust();
+			adjustParamMetric    = continuation.metricAdjust();
+			lattice.setAdjust(adjustParamThickness, adjustParamMetric);
+		}
+		else
+		{
+			/* set the adjustment parameters */
+			double thicknessAdjustSign = 1.0;
+			if (ThicknessAdjust < 1.0)	{thicknessAdjustSign = -1.0;}
+			// double adjustParamThickness	= 1.0 + (ThicknessAdjust - 1.0) * pow((1.0 - 5.0 * iter / NumberOfLoops),3);
+			adjustParamThickness	= ThicknessAdjust + (1.0 - ThicknessAdjust) * pow(5.0 * iter / NumberOfLoops,3);
+			/*double adjustParamThickness	= ThicknessAdjust + (1.0 - ThicknessAdjust) * 0.5*(1 + sin(3.141592*(5.0 * iter / NumberOfLoops) - 0.727)/abs(sin(3.141592*(5.0 * iter / NumberOfLoops) - 0.727))); */
+			// double adjustParamThickness	= pow(ThicknessAdjust + (1.0 - ThicknessAdjust) * iter / NumberOfLoops,-2);//adjust wgal then calibrate
+			if (adjustParamThickness*thicknessAdjustSign < thicknessAdjustSign)	{adjustParamThickness = 1.0;}
+			adjustParamMetric	= 1.0 + (MetricAdjust - 1.0) * (1.0 - 1.0 * iter / NumberOfLoops);
+			if (adjustParamMetric < 1)		{adjustParamMetric = 1.0;}
+			lattice.setAdjust(adjustParamThickness, adjustParamMetric);
+		}
 		
 		// double adjustParamThickness = ThicknessAdjust + (1.0 - ThicknessAdjust) * pow(5.0 * iter / NumberOfLoops,3);
 		// double adjustParamMetric = 1.0 + (MetricAdjust - 1.0) * (1.0 - 1.0 * iter / NumberOfLoops);
@@ -454,7 +549,12 @@ int main() {
 		// double adjustParamThickness = 1.0;
 		// double adjustParamMetric = 1.0;
 		/* perform an iteration */
-		status = gsl_multimin_fdfminimizer_iterate(optimizer);
+		{
+			Profiler::ScopedTimer timer(Profiler::Optimizer);
+			status = optimizer->iterate();
+		}
+		if (Profiler::enabled())
+			Profiler::recordIteration(iter, optimizer->f(), gsl_blas_dnrm2(optimizer->gradient()));
 	    // if (iter % 100 == 0 ) {
         // std::cout << "Iter " << iter
         //           << " E = " << lattice.energy()
@@ -480,9 +580,13 @@ int main() {
 		// lattice.setPositionVector(currentX);
 		
 		// }
+		/* exit only with the final parameters (fixed ramp: after 1/5 of maximum number of iterations, if adjusted) */
+		bool mayExit = adaptive ? continuation.finished()
+								: (((ThicknessAdjust == 1.0) && (MetricAdjust == 1.0)) || ((5.0 * iter / NumberOfLoops) > 1.0));
+		bool stalled = (status != 0);
 		if (status)
 		{
-			if (((ThicknessAdjust == 1.0) && (MetricAdjust == 1.0)) || ((5.0 * iter / NumberOfLoops) > 1.0)) /*Allow exit only after 1/5 of maximum number of iterations (if adjusted)*/
+			if (mayExit)
 			{
 				// std::cout << "Exit minimizer with status " << status << std::endl;
 				std::cout << "Exit minimizer with status " << status
@@ -499,24 +603,56 @@ int main() {
 		// }
 
 		/* check the size of the gradient */
-		status = gsl_multimin_test_gradient(optimizer->gradient, 1e-6);
+		status = gsl_multimin_test_gradient(optimizer->gradient(), 1e-6);
 		if (status == GSL_SUCCESS)
 		{
-			if (((ThicknessAdjust == 1.0) && (MetricAdjust == 1.0)) ||((5.0 * iter / NumberOfLoops) > 1.0)) /*Allow exit only after 1/5 of maximum number of iterations (if adjusted)*/
+			if (mayExit)
 			{
 				std::cout << "Minimum found" << std::endl;
 				break;
 			}
 		}
+
+		/* Adaptive continuation: move the parameters once the state has relaxed, */
+		/* and restart the minimizer on the new energy functional                 */
+		if (adaptive && continuation.update(gsl_blas_dnrm2(optimizer->gradient()), stalled))
+		{
+			lattice.setAdjust(continuation.thicknessAdjust(), continuation.metricAdjust());
+			gsl_vector_memcpy(IC, optimizer->x());
+			if (SmoothingSweeps > 0)
+			{
+				lattice.setPositionVector(IC);
+				lattice.relaxLocally(SmoothingSweeps);
+				lattice.getPositionVector(IC);
+			}
+			optimizer->set(IC);
+			std::cout << "Continuation level " << continuation.level() << " at iteration " << iter
+					  << ": thickness adjust " << continuation.thicknessAdjust()
+					  << ", metric adjust " << continuation.metricAdjust() << std::endl;
+		}
+
+		/* Finish with Newton-CG once the functional is final and the gradient is small */
+		if ((NewtonSwitch > 0.0) && (adjustParamThickness == 1.0) && (adjustParamMetric == 1.0) &&
+			(std::string(optimizer->name()) != "newton-cg") &&
+			(gsl_blas_dnrm2(optimizer->gradient()) < NewtonSwitch))
+		{
+			std::cout << "Switching to Newton-CG at iteration " << iter << std::endl;
+			gsl_vector_memcpy(IC, optimizer->x());
+			delete optimizer;
+			optimizer = new NewtonCGMinimizer(lattice);
+			optimizer->set(IC);
+		}
 		
 
 		if (iter%HowOftenToPrint==0)
 		{
+			Profiler::ScopedTimer timer(Profiler::Output);
 		/* print the current energy and thickness */
 			char *space = (char*)(" ");
-			double Es = lattice.stretchingEnergy() * pow(adjustParamThickness * adjustParamMetric, 0);
-			double Eb = lattice.bendingEnergy() * pow(adjustParamThickness * adjustParamMetric, 0);
-			double Eg = lattice.connectionEnergy()  * pow(adjustParamThickness * adjustParamMetric, 0);
+			EnergyBreakdown breakdown = lattice.energyBreakdown();
+			double Es = breakdown.stretching * pow(adjustParamThickness * adjustParamMetric, 0);
+			double Eb = breakdown.bending * pow(adjustParamThickness * adjustParamMetric, 0);
+			double Eg = breakdown.connection  * pow(adjustParamThickness * adjustParamMetric, 0);
     		double E  = Es + Eb + Eg;
 			energyFileHandle.write(iter);
 			energyFileHandle.write(space);
@@ -532,7 +668,7 @@ int main() {
 			energyFileHandle.newline();
 
 		/* Dump the surface to the openGL file */
-			double Efinal = lattice.stretchingEnergy() + lattice.bendingEnergy() + lattice.connectionEnergy();
+			double Efinal = breakdown.total;
 			int PercentDone = 100*iter/NumberOfLoops;
 			std::cout.precision(15);
 			std::cout << PercentDone << "% Done: " << "The current energy is " << Efinal << std::endl;
@@ -549,19 +685,21 @@ int main() {
 
 
 	/* Set the state of the system with final state */
-	double* ptr = gsl_vector_ptr(optimizer->x, 0);
+	double* ptr = gsl_vector_ptr(optimizer->x(), 0);
 	lattice.setPositionVector(ptr);
 
 	/* free the memory */
-	gsl_multimin_fdfminimizer_free(optimizer);
+	delete optimizer;
 	gsl_vector_free(IC);
 
 		/* Calculate the final energy and output it */
+	Profiler::ScopedTimer outputTimer(Profiler::Output);
 	std::cout.precision(15);
-	std::cout << "The final energy is " << lattice.energy() << std::endl;
+	EnergyBreakdown finalEnergy = lattice.energyBreakdown();
+	std::cout << "The final energy is " << finalEnergy.total << std::endl;
 	char *space = (char*)(" ");
-	double Es = lattice.stretchingEnergy();
-	double Eb = lattice.bendingEnergy();
+	double Es = finalEnergy.stretching;
+	double Eb = finalEnergy.bending;
 	double E = Es + Eb;
 	energyFileHandle.write(0);
 	energyFileHandle.write(space);
@@ -589,36 +727,20 @@ int main() {
     energyFileHandle.close();
     EFGLMNOutputFileHandle.close();  
 
-	return 0;
-}
+	/* Timers and counters, next to the energy file */
+	if (Profiler::enabled() && !Profiler::writeJSON(profileFileName))
+		Errors::Warning("Cannot write the profile " + profileFileName);
 
-
-/* ============================================================================== */
-/* FUNCTIONS FOR OPTIMIZER                                                        */
-/* ============================================================================== */
-double my_f(const gsl_vector *a_x, void *a_lattice)
-{
-	NonEuclideanShell *lattice_ptr = static_cast<NonEuclideanShell*>(a_lattice);
-	return lattice_ptr->getEnergy(a_x);
-}
-
-void my_df(const gsl_vector *a_x, void *a_lattice, gsl_vector *a_df)
-{
-	NonEuclideanShell *lattice_ptr = static_cast<NonEuclideanShell*>(a_lattice);
-	lattice_ptr->getEnergyGradient(a_x, a_df);
+	return 0;
 }
 
-void my_fdf(const gsl_vector *a_x, void *a_lattice, double *a_f, gsl_vector *a_df)
-{
-	NonEuclideanShell *lattice_ptr = static_cast<NonEuclideanShell*>(a_lattice);
-	lattice_ptr->getEnergyAndEnergyGradient(a_x, a_f, a_df);
-}
 
 /* ============================================================================== */
 /* INPUT FUNCTIONS (lattice parameters)                                           */
 /* ============================================================================== */
 TinyMatrix<double,2>  inputFunctionAbar(double u, double v)
 {
+	Profiler::ScopedTimer timer(Profiler::Formulas);
 
 	RVar uvar ("u", &u);
 	RVar vvar ("v", &v);
@@ -640,6 +762,7 @@ TinyMatrix<double,2>  inputFunctionAbar(double u, double v)
 
 TinyMatrix<double,2> inputFunctionBbar(double u, double v)
 {
+	Profiler::ScopedTimer timer(Profiler::Formulas);
 	RVar uvar ("u", &u);
 	RVar vvar ("v", &v);
 	RVar* vararray[2];
@@ -660,6 +783,7 @@ TinyMatrix<double,2> inputFunctionBbar(double u, double v)
 
 double inputFunctionThickness(double u, double v)
 {
+	Profiler::ScopedTimer timer(Profiler::Formulas);
 	RVar uvar ("u", &u);
 	RVar vvar ("v", &v);
 	RVar* vararray[2];
@@ -672,6 +796,7 @@ double inputFunctionThickness(double u, double v)
 
 double inputFunctionLambda(double u, double v)
 {
+	Profiler::ScopedTimer timer(Profiler::Formulas);
 	RVar uvar ("u", &u);
 	RVar vvar ("v", &v);
 	RVar* vararray[2];
@@ -687,6 +812,7 @@ double inputFunctionLambda(double u, double v)
 
 double inputFunctionMu (double u, double v)
 {
+	Profiler::ScopedTimer timer(Profiler::Formulas);
 	RVar uvar ("u", &u);
 	RVar vvar ("v", &v);
 	RVar* vararray[2];
@@ -702,6 +828,7 @@ double inputFunctionMu (double u, double v)
 
 TinyVector<double,3>  inputFunctionPos0(double u, double v)
 {
+	Profiler::ScopedTimer timer(Profiler::Formulas);
 
 	RVar uvar ("u", &u);
 	RVar vvar ("v", &v);
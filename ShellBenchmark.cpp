@@ -0,0 +1,281 @@
+/*
+ *  ShellBenchmark.cpp
+ *  RKLibrary
+ *
+ */
+
+/*
+ Microbenchmark of the Face kernels and of the whole-shell evaluation on
+ synthetic structured meshes: a rectangle (clamped along u = 0) and a disc
+ (clamped at the center), n x n cells of two triangles each.
+
+ Face kernels (one thread): stretchingEnergy, bendingEnergy, connectionEnergy,
+ EFG, LMN and setForce, over all faces. Shell (1, 2, 4, ... threads): energy()
+ of a fresh state and getEnergyAndEnergyGradient. Each is run with the
+ connection term off (lambdaG = muG = 0) and on.
+
+ The output is CSV, one row per measurement, comment lines start with #:
+	benchmark,mesh,n,nodes,faces,terms,threads,repeats,ns_per_face,faces_per_s
+
+ Usage: ShellBenchmark [rectangle|disc|all] [n] [seconds per measurement] [max threads]
+ Build: g++ -O2 -fopenmp -I. ShellBenchmark.cpp NonEuclideanShell.cpp Profiler.cpp PerfCounters.cpp MeshBuilder.cpp -lgsl -lgslcblas -o ShellBenchmark
+*/
+
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "Main.H"
+#include "NonEuclideanShell.H"
+#include "MeshBuilder.H"
+
+static double s_sink = 0.0;
+
+/* ============================================================================== */
+/* Synthetic meshes                                                               */
+/* ============================================================================== */
+/* Nodes (u, v, fixed flag) and CCW triangles of an n x n grid. The disc is the */
+/* square [-1,1]^2 mapped onto the unit disc, which keeps the grid structure    */
+static void makeMesh(const std::string &a_type, int a_n,
+					 std::vector< TinyVector<double,2> > &a_uv, std::vector<int> &a_fixed,
+					 std::vector< TinyVector<int,3> > &a_triangles)
+{
+	bool disc = (a_type == "disc");
+	double h  = 1.0/a_n;
+
+	a_uv.clear();
+	a_fixed.clear();
+	a_triangles.clear();
+	for (int j=0; j<=a_n; j++)
+		for (int i=0; i<=a_n; i++)
+		{
+			TinyVector<double,2> uv;
+			if (disc)
+			{
+				double x = 2.0*i*h - 1.0, y = 2.0*j*h - 1.0;
+				uv(0) = x*sqrt(1.0 - 0.5*y*y);
+				uv(1) = y*sqrt(1.0 - 0.5*x*x);
+				a_fixed.push_back((fabs(x) < 1.5*h && fabs(y) < 1.5*h) ? -1 : -2);
+			}
+			else
+			{
+				uv(0) = i*h;
+				uv(1) = j*h;
+				a_fixed.push_back((i == 0) ? -1 : -2);
+			}
+			a_uv.push_back(uv);
+		}
+
+	for (int j=0; j<a_n; j++)
+		for (int i=0; i<a_n; i++)
+		{
+			int a = j*(a_n+1) + i, b = a + 1, c = a + a_n + 1, d = c + 1;
+			TinyVector<int,3> t1, t2;
+			t1(0) = a; t1(1) = b; t1(2) = d;
+			t2(0) = a; t2(1) = d; t2(2) = c;
+			a_triangles.push_back(t1);
+			a_triangles.push_back(t2);
+		}
+}
+
+/* Write the mesh in the format read by the NonEuclideanShell constructor */
+static void writeMesh(const std::string &a_prefix,
+					  const std::vector< TinyVector<double,2> > &a_uv, const std::vector<int> &a_fixed,
+					  const std::vector< TinyVector<int,3> > &a_triangles)
+{
+	MeshBuilder mesh(a_uv, a_triangles);
+	for (size_t i=0; i<a_fixed.size(); i++) mesh.setFixed(i, a_fixed[i]);
+	mesh.buildNeighbors();
+	if (!mesh.writeVertices(a_prefix + "_Vertices") || !mesh.writeFaces(a_prefix + "_Faces"))
+		Errors::Abort("Cannot write the mesh " + a_prefix);
+}
+
+/* ============================================================================== */
+/* Reference forms: a slightly anisotropic metric, a curvature and a bumpy start  */
+/* ============================================================================== */
+static double thickness(double, double) {return 0.05;}
+static double lambda(double, double)    {return 0.3;}
+static double mu(double, double)        {return 0.4;}
+
+static TinyMatrix<double,2> abar(double, double)
+{
+	TinyMatrix<double,2> a;
+	a(0,0) = 1.0; a(0,1) = a(1,0) = 0.05; a(1,1) = 1.1;
+	return a;
+}
+
+static TinyMatrix<double,2> bbar(double, double)
+{
+	TinyMatrix<double,2> b;
+	b(0,0) = 0.5; b(1,1) = 0.3;
+	return b;
+}
+
+static TinyVector<double,3> position0(double u, double v)
+{
+	TinyVector<double,3> p;
+	p(0) = u; p(1) = v; p(2) = 0.05*sin(3.0*u)*cos(2.0*v);
+	return p;
+}
+
+static TinyMatrix<TinyMatrix<double,2>,2> gammabar(double, double)
+{
+	return TinyMatrix<TinyMatrix<double,2>,2>();
+}
+
+/* ============================================================================== */
+/* Timing                                                                         */
+/* ============================================================================== */
+/* Seconds per call of a_op, repeated until a_minTime has elapsed */
+template <class OP>
+static double timeIt(double a_minTime, int &a_repeats, OP a_op)
+{
+	a_op();
+	for (a_repeats=1; ; a_repeats*=2)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int r=0; r<a_repeats; r++) a_op();
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (elapsed >= a_minTime || a_repeats >= (1<<24)) return elapsed/a_repeats;
+	}
+}
+
+struct BenchmarkCase
+{
+	std::string mesh;
+	int         n;
+	int         nodes;
+	int         faces;
+	const char* terms;
+};
+
+static void report(const BenchmarkCase &a_case, const char *a_name, int a_threads, int a_repeats, double a_seconds)
+{
+	double nsPerFace = 1e9*a_seconds/a_case.faces;
+	std::cout << a_name << "," << a_case.mesh << "," << a_case.n << "," << a_case.nodes << ","
+			  << a_case.faces << "," << a_case.terms << "," << a_threads << "," << a_repeats << ","
+			  << std::fixed << std::setprecision(2) << nsPerFace << ","
+			  << std::setprecision(0) << 1e9/nsPerFace << std::endl;
+	std::cout.unsetf(std::ios::floatfield);
+}
+
+/* ============================================================================== */
+/* Benchmark one mesh with the connection term off or on */
+static void benchmark(const std::string &a_mesh, int a_n, bool a_connection, double a_minTime, int a_maxThreads)
+{
+	std::vector< TinyVector<double,2> > uv;
+	std::vector<int>                    fixed;
+	std::vector< TinyVector<int,3> >    triangles;
+	makeMesh(a_mesh, a_n, uv, fixed, triangles);
+
+	/* The shell reads its mesh from files, and reports on std::cout while loading */
+	std::string prefix = "ShellBenchmark_" + a_mesh;
+	writeMesh(prefix, uv, fixed, triangles);
+	std::ostringstream     log;
+	std::streambuf*        coutBuffer = std::cout.rdbuf(log.rdbuf());
+	NonEuclideanShell      shell(prefix + "_Vertices", prefix + "_Faces");
+	double                 weightG = a_connection ? 1.0 : 0.0;
+	shell.setVerbosity(0);
+	shell.setParameters(&thickness, &lambda, &mu, &abar, &bbar, &position0, &gammabar, weightG, weightG);
+	shell.setAdjust(0.7, 0.9);
+	std::cout.rdbuf(coutBuffer);
+	remove((prefix + "_Vertices").c_str());
+	remove((prefix + "_Faces").c_str());
+
+	/* Two states differing at every free node, so that each evaluation is a full one */
+	int size = shell.SizeOfOptimizationProblem();
+	std::vector<double> x0(size), x1(size), gradient(size);
+	shell.getPositionVector(&x0[0]);
+	for (int i=0; i<size; i++)
+	{
+		x0[i] += 1e-2*sin(7.0*i);
+		x1[i]  = x0[i] + 1e-3*cos(5.0*i);
+	}
+	shell.setPositionVector(&x0[0]);
+
+	BenchmarkCase bc;
+	bc.mesh  = a_mesh;
+	bc.n     = a_n;
+	bc.nodes = shell.getNodes().length();
+	bc.faces = shell.getFaces().length();
+	bc.terms = a_connection ? "all" : "stretching+bending";
+
+	/* Face kernels, one thread */
+	const Vector<Face*> &faces = shell.getFaces();
+	int numberFaces = faces.length(), repeats = 0;
+	double t;
+
+	t = timeIt(a_minTime, repeats, [&]() {for (int i=0; i<numberFaces; i++) s_sink += faces(i)->stretchingEnergy();});
+	report(bc, "Face::stretchingEnergy", 1, repeats, t);
+	t = timeIt(a_minTime, repeats, [&]() {for (int i=0; i<numberFaces; i++) s_sink += faces(i)->bendingEnergy();});
+	report(bc, "Face::bendingEnergy", 1, repeats, t);
+	if (a_connection)
+	{
+		t = timeIt(a_minTime, repeats, [&]() {for (int i=0; i<numberFaces; i++) s_sink += faces(i)->connectionEnergy();});
+		report(bc, "Face::connectionEnergy", 1, repeats, t);
+	}
+	t = timeIt(a_minTime, repeats, [&]() {for (int i=0; i<numberFaces; i++) s_sink += faces(i)->EFG()(0);});
+	report(bc, "Face::EFG", 1, repeats, t);
+	t = timeIt(a_minTime, repeats, [&]() {for (int i=0; i<numberFaces; i++) s_sink += faces(i)->LMN()(0);});
+	report(bc, "Face::LMN", 1, repeats, t);
+	shell.initializeForce();
+	t = timeIt(a_minTime, repeats, [&]() {for (int i=0; i<numberFaces; i++) faces(i)->setForce();});
+	report(bc, "Face::setForce", 1, repeats, t);
+
+	/* Whole shell, 1, 2, 4, ... threads */
+	for (int threads=1; ; threads*=2)
+	{
+		threads = min(threads, a_maxThreads);
+#ifdef _OPENMP
+		omp_set_num_threads(threads);
+#endif
+		bool flip = false;
+		t = timeIt(a_minTime, repeats, [&]() {
+			flip = !flip;
+			s_sink += shell.getEnergy(flip ? &x1[0] : &x0[0]);});
+		report(bc, "NonEuclideanShell::energy", threads, repeats, t);
+
+		double energy = 0.0;
+		t = timeIt(a_minTime, repeats, [&]() {
+			flip = !flip;
+			shell.getEnergyAndEnergyGradient(flip ? &x1[0] : &x0[0], &energy, &gradient[0]);
+			s_sink += energy;});
+		report(bc, "NonEuclideanShell::getEnergyAndEnergyGradient", threads, repeats, t);
+		if (threads == a_maxThreads) break;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::string mesh    = (argc > 1) ? argv[1] : "all";
+	int         n       = (argc > 2) ? atoi(argv[2]) : 64;
+	double      minTime = (argc > 3) ? atof(argv[3]) : 0.2;
+	int         threads = 1;
+#ifdef _OPENMP
+	threads = omp_get_max_threads();
+#endif
+	if (argc > 4) threads = atoi(argv[4]);
+
+	if ((mesh != "rectangle" && mesh != "disc" && mesh != "all") || n < 2 || threads < 1)
+	{
+		std::cerr << "Usage: " << argv[0] << " [rectangle|disc|all] [n] [seconds per measurement] [max threads]" << std::endl;
+		return 1;
+	}
+
+	std::cout << "# ShellBenchmark " << mesh << " n=" << n << " max threads=" << threads << std::endl;
+	std::cout << "benchmark,mesh,n,nodes,faces,terms,threads,repeats,ns_per_face,faces_per_s" << std::endl;
+	for (int k=0; k<2; k++)
+	{
+		const char *type = (k == 0) ? "rectangle" : "disc";
+		if (mesh != "all" && mesh != type) continue;
+		benchmark(type, n, false, minTime, threads);
+		benchmark(type, n, true,  minTime, threads);
+	}
+
+	/* keep the results alive */
+	if (s_sink == 1.2345) std::cout << s_sink << std::endl;
+	return 0;
+}
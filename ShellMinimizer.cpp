@@ -0,0 +1,170 @@
+/*
+ *  ShellMinimizer.cpp
+ *  RKLibrary
+ *
+ */
+
+#include "ShellMinimizer.H"
+#include "LBFGSMinimizer.H"
+#include "FIREMinimizer.H"
+#include "NewtonCGMinimizer.H"
+#include <cstring>
+
+
+/* ============================================================================== */
+/* CachedShellEvaluator CachedShellEvaluator CachedShellEvaluator               */
+/* ============================================================================== */
+/* Constructor */
+CachedShellEvaluator::CachedShellEvaluator(NonEuclideanShell &a_shell) :
+m_shell(a_shell),
+m_size(a_shell.SizeOfOptimizationProblem()),
+m_x(new double[m_size > 0 ? m_size : 1]),
+m_gradient(new double[m_size > 0 ? m_size : 1]),
+m_energy(0.0),
+m_hasEnergy(false),
+m_hasGradient(false),
+m_version(0),
+m_energyCalls(0),
+m_gradientCalls(0)
+{
+}
+
+/* ============================================================================== */
+/* Destructor */
+CachedShellEvaluator::~CachedShellEvaluator()
+{
+	delete [] m_x;
+	delete [] m_gradient;
+}
+
+/* ============================================================================== */
+/* Is a_x the state of the last evaluation (with the same parameters)? */
+bool CachedShellEvaluator::matches(const double *a_x) const
+{
+	if (m_version != m_shell.parameterVersion()) return false;
+	return memcmp(a_x, m_x, sizeof(double)*m_size) == 0;
+}
+
+/* ============================================================================== */
+/* Energy */
+double CachedShellEvaluator::energy(const double *a_x)
+{
+	if (m_hasEnergy && matches(a_x)) return m_energy;
+
+	m_energy      = m_shell.getEnergy(a_x);
+	m_hasEnergy   = true;
+	m_hasGradient = false;
+	m_version     = m_shell.parameterVersion();
+	memcpy(m_x, a_x, sizeof(double)*m_size);
+	m_energyCalls++;
+
+	return m_energy;
+}
+
+/* ============================================================================== */
+/* Energy and gradient */
+double CachedShellEvaluator::energyAndGradient(const double *a_x, double *a_gradient)
+{
+	if (!(m_hasGradient && matches(a_x)))
+	{
+		m_shell.getEnergyAndEnergyGradient(a_x, &m_energy, m_gradient);
+		m_hasEnergy   = true;
+		m_hasGradient = true;
+		m_version     = m_shell.parameterVersion();
+		memcpy(m_x, a_x, sizeof(double)*m_size);
+		m_gradientCalls++;
+	}
+
+	memcpy(a_gradient, m_gradient, sizeof(double)*m_size);
+	return m_energy;
+}
+
+
+/* ============================================================================== */
+/* ShellMinimizer ShellMinimizer ShellMinimizer ShellMinimizer ShellMinimizer    */
+/* ============================================================================== */
+/* Construct a minimizer by name */
+ShellMinimizer* ShellMinimizer::create(const std::string &a_name, NonEuclideanShell &a_shell)
+{
+	if (a_name == "cg")
+		return new GSLMinimizer(a_shell, gsl_multimin_fdfminimizer_conjugate_fr, 0.01, 1e-5);
+	if (a_name == "bfgs2")
+		return new GSLMinimizer(a_shell, gsl_multimin_fdfminimizer_vector_bfgs2, 0.01, 1e-5);
+	if (a_name == "lbfgs")
+		return new LBFGSMinimizer(a_shell);
+	if (a_name == "lbfgs-pc")
+		return new PreconditionedLBFGSMinimizer(a_shell);
+	if (a_name == "fire")
+		return new FIREMinimizer(a_shell);
+	if (a_name == "newton")
+		return new NewtonCGMinimizer(a_shell);
+
+	return NULL;
+}
+
+/* ============================================================================== */
+/* Inner product of two state vectors */
+double ShellMinimizer::dot(const double *a_u, const double *a_v) const
+{
+	double ret = 0.0;
+	for (int i=0; i<m_size; i++) ret += a_u[i]*a_v[i];
+	return ret;
+}
+
+
+/* ============================================================================== */
+/* GSLMinimizer GSLMinimizer GSLMinimizer GSLMinimizer GSLMinimizer GSLMinimizer */
+/* ============================================================================== */
+/* Callbacks for the GSL optimizer */
+static double my_f(const gsl_vector *a_x, void *a_lattice)
+{
+	NonEuclideanShell *lattice_ptr = static_cast<NonEuclideanShell*>(a_lattice);
+	return lattice_ptr->getEnergy(a_x);
+}
+
+static void my_df(const gsl_vector *a_x, void *a_lattice, gsl_vector *a_df)
+{
+	NonEuclideanShell *lattice_ptr = static_cast<NonEuclideanShell*>(a_lattice);
+	lattice_ptr->getEnergyGradient(a_x, a_df);
+}
+
+static void my_fdf(const gsl_vector *a_x, void *a_lattice, double *a_f, gsl_vector *a_df)
+{
+	NonEuclideanShell *lattice_ptr = static_cast<NonEuclideanShell*>(a_lattice);
+	lattice_ptr->getEnergyAndEnergyGradient(a_x, a_f, a_df);
+}
+
+/* ============================================================================== */
+/* Constructor */
+GSLMinimizer::GSLMinimizer(NonEuclideanShell &a_shell,
+						   const gsl_multimin_fdfminimizer_type *a_method,
+						   double a_stepSize,
+						   double a_tolerance) :
+ShellMinimizer(a_shell),
+m_optimizer(gsl_multimin_fdfminimizer_alloc(a_method, m_size)),
+m_function(),
+m_stepSize(a_stepSize),
+m_tolerance(a_tolerance),
+m_name(a_method->name)
+{
+	/* Define the function to be minimized */
+	m_function.n      = m_size;
+	m_function.f      = &my_f;
+	m_function.df     = &my_df;
+	m_function.fdf    = &my_fdf;
+	m_function.params = static_cast<void *>(&m_shell);
+}
+
+/* ============================================================================== */
+/* Destructor */
+GSLMinimizer::~GSLMinimizer()
+{
+	gsl_multimin_fdfminimizer_free(m_optimizer);
+}
+
+/* ============================================================================== */
+/* Set the initial state */
+void GSLMinimizer::set(const gsl_vector *a_x)
+{
+	gsl_multimin_fdfminimizer_set(m_optimizer, &m_function, a_x, m_stepSize, m_tolerance);
+}
@@ -0,0 +1,154 @@
+/*
+ *  TinyMatrixBenchmark.cpp
+ *  RKLibrary
+ *
+ */
+
+/*
+ Microbenchmark of the closed-form 2x2 and 3x3 TinyMatrix algebra against the
+ generic LU loops (luDecomposeGeneric, luSolveGeneric), for the sizes used by
+ the Face kernels. Prints the time per operation and the largest difference
+ between the two results.
+
+ Build: g++ -O2 -I. TinyMatrixBenchmark.cpp -o TinyMatrixBenchmark
+*/
+
+#include <chrono>
+#include <vector>
+#include "Main.H"
+#include "TinyVector.H"
+#include "TinyMatrix.H"
+
+static double s_sink = 0.0;
+
+/* Random, well conditioned matrices and right hand sides */
+template <int SIZE>
+static void makeProblems(int a_count, std::vector< TinyMatrix<double,SIZE> > &a_mats,
+						 std::vector< TinyVector<double,SIZE> > &a_rhs)
+{
+	a_mats.resize(a_count);
+	a_rhs.resize(a_count);
+	for (int n=0; n<a_count; n++)
+	{
+		for (int i=0; i<SIZE; i++)
+		{
+			for (int j=0; j<SIZE; j++) a_mats[n](i,j) = rand()/(double)RAND_MAX - 0.5;
+			a_mats[n](i,i) += SIZE;
+			a_rhs[n](i) = rand()/(double)RAND_MAX - 0.5;
+		}
+	}
+}
+
+/* Inverse by the generic LU loops */
+template <int SIZE>
+static TinyMatrix<double,SIZE> genericInverse(const TinyMatrix<double,SIZE> &a_mat)
+{
+	TinyMatrix<double,SIZE>   lu = a_mat;
+	TinyVector<int,SIZE>      pivot;
+	luDecomposeGeneric(lu, pivot);
+	TinyMatrix<double,SIZE> ret;
+	for (int j=0; j<SIZE; j++)
+	{
+		TinyVector<double,SIZE> unit;
+		unit(j) = 1.0;
+		TinyVector<double,SIZE> column = luSolveGeneric(lu, pivot, unit);
+		for (int i=0; i<SIZE; i++) ret(i,j) = column(i);
+	}
+	return ret;
+}
+
+/* Time a_op over all problems a_repeat times, in ns per call */
+template <class OP>
+static double timeIt(int a_count, int a_repeat, OP a_op)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int r=0; r<a_repeat; r++)
+		for (int n=0; n<a_count; n++) s_sink += a_op(n);
+	std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+	return std::chrono::duration<double,std::nano>(stop - start).count() / ((double)a_count * a_repeat);
+}
+
+static void report(const char *a_name, double a_generic, double a_closed, double a_difference)
+{
+	std::cout << std::setw(22) << std::left << a_name
+			  << " generic " << std::setw(8) << std::right << std::fixed << std::setprecision(2) << a_generic << " ns"
+			  << "   closed form " << std::setw(8) << a_closed << " ns"
+			  << "   speedup " << std::setw(5) << a_generic/a_closed
+			  << "   max difference " << std::scientific << std::setprecision(2) << a_difference << std::endl;
+}
+
+template <int SIZE>
+static void benchmark(int a_count, int a_repeat)
+{
+	std::vector< TinyMatrix<double,SIZE> > mats;
+	std::vector< TinyVector<double,SIZE> > rhs;
+	makeProblems<SIZE>(a_count, mats, rhs);
+
+	/* Factors for the substitution benchmark (done once, as in Face::initialize) */
+	std::vector< TinyMatrix<double,SIZE> > lu(mats);
+	std::vector< TinyVector<int,SIZE> >    pivot(a_count);
+	for (int n=0; n<a_count; n++) luDecompose(lu[n], pivot[n]);
+
+	/* Differences between the two results */
+	double dInverse = 0.0, dSolve = 0.0, dLU = 0.0, dDet = 0.0;
+	for (int n=0; n<a_count; n++)
+	{
+		TinyMatrix<double,SIZE> A = mats[n].inverse(), B = genericInverse<SIZE>(mats[n]);
+		TinyVector<double,SIZE> x = solve(mats[n], rhs[n]), y = luSolveGeneric(lu[n], pivot[n], rhs[n]);
+		TinyVector<double,SIZE> z = luSolve(lu[n], pivot[n], rhs[n]);
+		for (int i=0; i<SIZE; i++)
+		{
+			for (int j=0; j<SIZE; j++) dInverse = max(dInverse, fabs(A(i,j) - B(i,j)));
+			dSolve = max(dSolve, fabs(x(i) - y(i)));
+			dLU    = max(dLU,    fabs(z(i) - y(i)));
+		}
+		double detLU = 1.0;
+		for (int i=0; i<SIZE; i++) detLU *= (pivot[n](i) == i) ? lu[n](i,i) : -lu[n](i,i);
+		dDet = max(dDet, fabs(mats[n].det() - detLU));
+	}
+
+	std::cout << SIZE << "x" << SIZE << " (" << a_count << " matrices, " << a_repeat << " repeats)" << std::endl;
+
+	report("det",
+		   timeIt(a_count, a_repeat, [&](int n) {
+				TinyMatrix<double,SIZE> f = mats[n]; TinyVector<int,SIZE> p; luDecomposeGeneric(f, p);
+				double d = 1.0; for (int i=0; i<SIZE; i++) d *= (p(i) == i) ? f(i,i) : -f(i,i);
+				return d;}),
+		   timeIt(a_count, a_repeat, [&](int n) {return mats[n].det();}),
+		   dDet);
+	report("inverse",
+		   timeIt(a_count, a_repeat, [&](int n) {return genericInverse<SIZE>(mats[n])(0,0);}),
+		   timeIt(a_count, a_repeat, [&](int n) {return mats[n].inverse()(0,0);}),
+		   dInverse);
+	report("solve (LU / Cramer)",
+		   timeIt(a_count, a_repeat, [&](int n) {
+				TinyMatrix<double,SIZE> f = mats[n]; TinyVector<int,SIZE> p; luDecomposeGeneric(f, p);
+				return luSolveGeneric(f, p, rhs[n])(0);}),
+		   timeIt(a_count, a_repeat, [&](int n) {return solve(mats[n], rhs[n])(0);}),
+		   dSolve);
+	report("luSolve (factored)",
+		   timeIt(a_count, a_repeat, [&](int n) {return luSolveGeneric(lu[n], pivot[n], rhs[n])(0);}),
+		   timeIt(a_count, a_repeat, [&](int n) {return luSolve(lu[n], pivot[n], rhs[n])(0);}),
+		   dLU);
+	report("trace(A*B)",
+		   timeIt(a_count, a_repeat, [&](int n) {
+				/* the full product: trace() of the product expression only evaluates its diagonal */
+				TinyMatrix<double,SIZE> P = mats[n]*mats[(n+1)%a_count];
+				return P.trace();}),
+		   timeIt(a_count, a_repeat, [&](int n) {return traceProduct(mats[n], mats[(n+1)%a_count]);}),
+		   0.0);
+}
+
+int main(int argc, char **argv)
+{
+	int count  = (argc > 1) ? atoi(argv[1]) : 4096;
+	int repeat = (argc > 2) ? atoi(argv[2]) : 200;
+
+	srand(12345);
+	benchmark<2>(count, repeat);
+	benchmark<3>(count, repeat);
+
+	/* keep the results alive */
+	if (s_sink == 1.2345) std::cout << s_sink << std::endl;
+	return 0;
+}
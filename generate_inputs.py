@@ -1,4 +1,5 @@
 import os
+import subprocess
 import numpy as np
 from meshpy.triangle import MeshInfo, build
 
@@ -28,13 +29,16 @@ def create_input_files(sim_name,
                        domain_type,
                        domain_params,
                        max_area=0.001,
-                       tols=(0,0)):
+                       tols=(0,0),
+                       preprocessor=None):
     """
     Creates:
       {sim_name}_p-distmesh.dat   raw distmesh points
       {sim_name}_t-distmesh.dat   raw distmesh triangles
       {sim_name}_Vertices         MATLAB-style 4×N array
       {sim_name}_Faces            MATLAB-style 10×M array
+    If preprocessor is the path of the MeshPreprocessor executable, it writes
+    the Vertices and Faces files (the same files, much faster on large meshes).
     """
     os.makedirs(output_dir, exist_ok=True)
     # 1) build boundary
@@ -72,6 +76,10 @@ def create_input_files(sim_name,
         f.write(f"{len(T_raw)}\n")
         for i,tri in enumerate(T_raw):
             f.write(f"{i}\t{tri[0]}\t{tri[1]}\t{tri[2]}\n")
+    if preprocessor is not None:
+        subprocess.run([preprocessor, pfile, tfile, os.path.join(output_dir, sim_name),
+                        'clamp', '0.05', '0'], check=True)
+        return
     N = len(P_raw)
     V = np.zeros((4, N), dtype=float)
     V[0, :] = np.arange(N)
@@ -140,6 +148,32 @@ def create_input_files(sim_name,
     
 
 
+def create_mesh_hierarchy(sim_name,
+                          output_dir,
+                          domain_type,
+                          domain_params,
+                          max_area=0.001,
+                          levels=2,
+                          coarsening=4.0,
+                          tols=(0,0),
+                          preprocessor=None):
+    """
+    Creates the coarse meshes {sim_name}_L{k} (k=levels-1 is the coarsest),
+    each with max_area scaled by coarsening**(k+1). The meshes need not be
+    nested. Returns the (Vertices, Faces) file pairs coarsest first, ready
+    for params['coarse_meshes'].
+    """
+    pairs = []
+    for k in reversed(range(levels)):
+        name = f"{sim_name}_L{k}"
+        create_input_files(name, output_dir, domain_type, domain_params,
+                           max_area=max_area * coarsening**(k+1), tols=tols,
+                           preprocessor=preprocessor)
+        pairs.append((os.path.join(output_dir, f"{name}_Vertices"),
+                      os.path.join(output_dir, f"{name}_Faces")))
+    return pairs
+
+
 def make_in_file(params, output_dir, sim_name):
     lines = []
     lines.append(params['vertices_file'])
@@ -170,6 +204,28 @@ def make_in_file(params, output_dir, sim_name):
         str(int(params['restart']))
     ])
 
+    # optional keyword-value settings (read until the end of the input)
+    if 'minimizer' in params:
+        lines.extend(['Minimizer', str(params['minimizer'])])
+    if 'fire_time_step' in params:
+        lines.extend(['FIRETimeStep', str(params['fire_time_step'])])
+    if 'newton_switch' in params:
+        lines.extend(['NewtonSwitch', str(params['newton_switch'])])
+    for vfile, ffile in params.get('coarse_meshes', []):
+        lines.extend(['CoarseMesh', vfile, ffile])
+    if 'coarse_iterations' in params:
+        lines.extend(['CoarseIterations', str(params['coarse_iterations'])])
+    if 'continuation' in params:
+        lines.extend(['Continuation', str(params['continuation'])])
+    if 'continuation_tolerance' in params:
+        lines.extend(['ContinuationTolerance', str(params['continuation_tolerance'])])
+    if 'smoothing_sweeps' in params:
+        lines.extend(['SmoothingSweeps', str(params['smoothing_sweeps'])])
+    if 'profile' in params:
+        lines.extend(['Profile', str(int(params['profile']))])
+    if 'hardware_counters' in params:
+        lines.extend(['HardwareCounters', str(int(params['hardware_counters']))])
+
     in_file = os.path.join(output_dir, f'run_input_{sim_name}.txt')
     with open(in_file,'w') as f:
         f.write("\n".join(lines))